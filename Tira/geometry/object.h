@@ -32,7 +32,7 @@ namespace tira {
 
         Bound3f()
             : min(float3::max())
-            , max(float3::min()) {}
+            , max(-float3::max()) {}
 
         Bound3f(float3 const& _min, float3 const& _max)
             : min(_min)
@@ -177,6 +177,17 @@ namespace tira {
             return std::max(tzmin, tmin);
         }
 #endif
+
+        // Parametric range of the ray inside the bound clamped to [t_min, t_max], false if it misses.
+        bool intersect(Ray const& ray, float& t0, float& t1) const {
+            t0 = ray.t_min;
+            t1 = ray.t_max;
+            for (int a = 0; a < 3; ++a) {
+                t0 = std::max(t0, ((*this)[ray.sign[a]][a] - ray.origin[a]) * ray.inv_dir[a]);
+                t1 = std::min(t1, ((*this)[1 - ray.sign[a]][a] - ray.origin[a]) * ray.inv_dir[a]);
+            }
+            return t0 <= t1;
+        }
     };
 
     inline std::ostream& operator<<(std::ostream& os, Bound3f const& b) {
@@ -197,9 +208,21 @@ namespace tira {
         virtual float3 get_max() const = 0;
         virtual Bound3f get_bound() const = 0;
         virtual float get_area() const = 0;
+        // Recomputes cached geometry after the defining positions changed, e.g. for refitting BVH.
+        virtual void update_geometry() {}
 
         virtual void intersect(Ray const& ray, Intersection& isect) const = 0;
+        // Fills surface attributes of a hit record produced by intersect.
+        virtual void compute_surface_interaction(Ray const& ray, Intersection& isect) const = 0;
         virtual void sample(Intersection& isect, float& pdf) const = 0;
+
+        // Whether the ray hits the object in [t_min, t_max), no attribute is computed.
+        virtual bool occluded(Ray const& ray, float t_max) const {
+            Intersection isect;
+            isect.distance = t_max;
+            intersect(ray, isect);
+            return isect.hit && isect.distance < t_max;
+        }
     };
 
 } // namespace tira
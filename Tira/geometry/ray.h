@@ -45,6 +45,10 @@ namespace tira {
             set_direction(d);
         }
 
+        Ray(float3 const& o, float3 const& d, float _t_min) : origin(o), t_min(_t_min) {
+            set_direction(d);
+        }
+
         void set_origin(float3 const& o) {
             origin = o;
         }
@@ -66,17 +70,25 @@ namespace tira {
         }
     };
 
+    /**
+     * Traversal only fills the hit record (hit, distance, object, material, barycentric),
+     * surface attributes are computed once for the closest hit by Object::compute_surface_interaction.
+     */
     struct Intersection {
         bool hit = false;
+        float distance = std::numeric_limits<float>::max();
+        float2 barycentric;
+        Material* material = nullptr;
+        Object* object = nullptr;
+        // Instance whose shared mesh holds object, surface attributes are then computed through it.
+        Object* instance = nullptr;
+
         bool back_face = false;
         float3 position;
         float3 normal;
         float3 tangent;
         float3 bitangent;
-        float distance = std::numeric_limits<float>::max();
         float2 uv;
-        Material* material = nullptr;
-        Object* object = nullptr;
     };
 
 } // namespace tira
@@ -6,11 +6,34 @@
 #define PRIMITIVE_H
 
 #include <misc/utils.h>
-#include <scene/scene.h>
+#include <scene/material.h>
 #include <geometry/object.h>
 
 namespace tira {
 
+    // Nearest root at or beyond ray.t_min.
+    inline bool intersect_sphere(Ray const& ray, float3 const& center, float radius, float& t) {
+        float3 oc = ray.origin - center;
+        float a = dot(ray.direction, ray.direction);
+        float half_b = dot(oc, ray.direction);
+        float c = dot(oc, oc) - radius * radius;
+
+        float discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) {
+            return false;
+        }
+        float sqrt_d = std::sqrt(discriminant);
+
+        t = (-half_b - sqrt_d) / a;
+        if (t < ray.t_min) {
+            t = (-half_b + sqrt_d) / a;
+            if (t < ray.t_min) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     struct Sphere : Object {
         Sphere() {}
         virtual ~Sphere() {}
@@ -21,25 +44,16 @@ namespace tira {
         float area = 0.0f;
 
         virtual void intersect(Ray const& ray, Intersection& isect) const override {
-            float3 oc = ray.origin - center;
-            float a = dot(ray.direction, ray.direction);
-            float half_b = dot(oc, ray.direction);
-            float c = dot(oc, oc) - radius * radius;
-
-            float discriminant = half_b * half_b - a * c;
-            if (discriminant < 0) {
+            float t;
+            if (!intersect_sphere(ray, center, radius, t)) {
                 return;
             }
-            float sqrt_d = std::sqrt(discriminant);
 
-            float t = (-half_b - sqrt_d) / a;
-            if (t < ray.t_min) {
-                t = (-half_b + sqrt_d) / a;
-                if (t < ray.t_min) {
-                    return;
-                }
-            }
+            record_hit(t, isect);
+        }
 
+        // Updates isect with a hit at t if it is closer than the current one.
+        void record_hit(float t, Intersection& isect) const {
 #ifdef TRIANGLE_TOLERATE_LIGHT_CLOSE_TO_SURFACE
             float diff = t - isect.distance;
             if (isect.material && isect.material->emissive) {
@@ -65,18 +79,22 @@ namespace tira {
 
             isect.hit = true;
             isect.object = (Object*)this;
+            isect.instance = nullptr;
             isect.material = material;
             isect.distance = t;
+        }
 
-            if (ray.shadow_ray) {
-                return;
-            }
-
-            isect.position = ray.at(t);
+        virtual void compute_surface_interaction(Ray const& ray, Intersection& isect) const override {
+            isect.position = ray.at(isect.distance);
             isect.normal = (isect.position - center) / radius;
             isect.back_face = ray.direction.dot(isect.normal) > 0;
         }
 
+        virtual bool occluded(Ray const& ray, float t_max) const override {
+            float t;
+            return intersect_sphere(ray, center, radius, t) && t < t_max;
+        }
+
         virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override {
             // Pass.
         }
@@ -103,6 +121,11 @@ namespace tira {
             area = 4 * PI * radius * radius;
         }
 
+        virtual void update_geometry() override {
+            calc_bound();
+            calc_area();
+        }
+
         virtual float3 get_center() const override {
             return center;
         }
@@ -6,7 +6,7 @@
 #define TRIANGLE_H
 
 #include <misc/utils.h>
-#include <scene/scene.h>
+#include <scene/material.h>
 #include <geometry/object.h>
 
 namespace tira {
@@ -21,6 +21,32 @@ namespace tira {
         return ndc;
     }
 
+    // Möller–Trumbore test, t is not range checked.
+    inline bool intersect_triangle(Ray const& ray, float3 const& v0, float3 const& e01, float3 const& e02, float& t, float& u, float& v) {
+        auto pvec = ray.direction.cross(e02);
+        auto det = e01.dot(pvec);
+        // Parallel to triangle.
+        if (fabs(det) < EPSILON) {
+            return false;
+        }
+
+        auto det_inv = 1 / det;
+        auto tvec = ray.origin - v0;
+        u = tvec.dot(pvec) * det_inv;
+        if (u < 0 || u > 1) {
+            return false;
+        }
+
+        auto qvec = tvec.cross(e01);
+        v = ray.direction.dot(qvec) * det_inv;
+        if (v < 0 || u + v > 1) {
+            return false;
+        }
+
+        t = e02.dot(qvec) * det_inv;
+        return true;
+    }
+
     struct Triangle : Object {
         float3 pos[3];
         float3 normal;
@@ -39,32 +65,20 @@ namespace tira {
         virtual ~Triangle() {}
 
         virtual void intersect(Ray const& ray, Intersection& isect) const override {
-            auto pvec = ray.direction.cross(e02);
-            auto det = e01.dot(pvec);
-            // Parallel to triangle.
-            if (fabs(det) < EPSILON) {
-                return;
-            }
-
-            auto det_inv = 1 / det;
-            auto tvec = ray.origin - pos[0];
-            auto u = tvec.dot(pvec) * det_inv;
-            if (u < 0 || u > 1) {
+            float t, u, v;
+            if (!intersect_triangle(ray, pos[0], e01, e02, t, u, v)) {
                 return;
             }
 
-            auto qvec = tvec.cross(e01);
-            auto v = ray.direction.dot(qvec) * det_inv;
-            if (v < 0 || u + v > 1) {
-                return;
-            }
-
-            auto t = e02.dot(qvec) * det_inv;
-
             if (t < ray.t_min || t > ray.t_max) {
                 return;
             }
 
+            record_hit(t, u, v, isect);
+        }
+
+        // Updates isect with a hit at t and barycentric (u, v) if it is closer than the current one.
+        void record_hit(float t, float u, float v, Intersection& isect) const {
 #ifdef TRIANGLE_TOLERATE_LIGHT_CLOSE_TO_SURFACE
             float diff = t - isect.distance;
             if (isect.material && isect.material->emissive) {
@@ -90,15 +104,17 @@ namespace tira {
 
             isect.hit = true;
             isect.object = (Object*)this;
+            isect.instance = nullptr;
             isect.material = material;
             isect.distance = t;
+            isect.barycentric = float2(u, v);
+        }
 
-            if (ray.shadow_ray) {
-                return;
-            }
-
+        virtual void compute_surface_interaction(Ray const& ray, Intersection& isect) const override {
+            float u = isect.barycentric.u;
+            float v = isect.barycentric.v;
             isect.back_face = ray.direction.dot(normal) > 0;
-            isect.position = ray.at(t);
+            isect.position = ray.at(isect.distance);
             if (has_vn) {
                 isect.normal = normalize(vn[0] * (1 - u - v) + vn[1] * u + vn[2] * v);
             }
@@ -110,6 +126,11 @@ namespace tira {
             isect.bitangent = bitangent;
         }
 
+        virtual bool occluded(Ray const& ray, float t_max) const override {
+            float t, u, v;
+            return intersect_triangle(ray, pos[0], e01, e02, t, u, v) && t >= ray.t_min && t < t_max;
+        }
+
         virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override {
             auto v0 = to_ndc(pos[0], transform);
             auto v1 = to_ndc(pos[1], transform);
@@ -213,6 +234,16 @@ namespace tira {
             area = e01.cross(e02).norm() * .5f;
         }
 
+        virtual void update_geometry() override {
+            e01 = pos[1] - pos[0];
+            e02 = pos[2] - pos[0];
+            normal = e01.cross(e02).normalized();
+            calc_center();
+            calc_bound();
+            calc_area();
+            calc_tangent();
+        }
+
         virtual float3 get_center() const override {
             return center;
         }
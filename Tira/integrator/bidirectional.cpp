@@ -4,16 +4,10 @@
 
 #include <integrator/bidirectional.h>
 
-#define POISSON_POINTS_NUM 32
-
 namespace tira {
 
-    float3 BidirectionalIntegrator::get_pixel_color(int x, int y, int sample_id, Scene const& scene) {
+    float3 BidirectionalIntegrator::get_ray_color(Ray& camera_ray, Intersection& primary, Scene const& scene) {
         // [TODO] Use Spectrum struct to represent light.
-        auto const& u0 = poisson_disk[sample_id % POISSON_POINTS_NUM];
-        auto const& u1 = concentric_sample_dist(random_float2());
-
-        Ray camera_ray = scene.camera.get_ray(x, y, scene.scr_w, scene.scr_h, u0, u1);
         camera_ray.depth = max_depth;
 
         // MIS weights and L per depth.
@@ -22,10 +16,12 @@ namespace tira {
         for (int i = 0; i < NUM_LIGHT_SAMPLES; ++i) {
             float3 Le;
             float light_pdf;
+            // Camera and light sub-paths of each light sample take max_depth bounces of dimensions each.
+            start_dimension((2 * i + 1) * max_depth, SampleDimension::AreaLight);
             Ray light_ray = scene.sample_light_ray(Le, light_pdf);
             light_ray.depth = max_depth;
             Le = Le / light_pdf;
-            render_paths(camera_ray, light_ray, Le, scene, mis_weights, Ls);
+            render_paths(i, camera_ray, primary, light_ray, Le, scene, mis_weights, Ls);
         }
 
         float3 L = float3::zero();
@@ -36,13 +32,13 @@ namespace tira {
         return L;
     }
 
-    void BidirectionalIntegrator::render_paths(Ray const& camera_ray, Ray const& ligth_ray, float3 const& Le, Scene const& scene, std::vector<float>& mis_weights, std::vector<float3>& Ls) {
+    void BidirectionalIntegrator::render_paths(int path_id, Ray const& camera_ray, Intersection const& primary, Ray const& ligth_ray, float3 const& Le, Scene const& scene, std::vector<float>& mis_weights, std::vector<float3>& Ls) {
         std::vector<VertexInfo> camera_path;
         std::vector<VertexInfo> light_path;
         float totalWeight = 0.0f;
 
-        generate_path(camera_ray, camera_path, scene, PathType::Camera);
-        generate_path(ligth_ray, light_path, scene, PathType::Light);
+        generate_path(camera_ray, camera_path, scene, PathType::Camera, 2 * path_id * max_depth, &primary);
+        generate_path(ligth_ray, light_path, scene, PathType::Light, (2 * path_id + 1) * max_depth);
 
         int n_camera = camera_path.size();
         int n_light = light_path.size();
@@ -154,7 +150,7 @@ namespace tira {
         return std::abs(dot(w, n0) * dot(w, n1)) / (dist * dist);
     }
 
-    void BidirectionalIntegrator::generate_path(Ray const& init_ray, std::vector<VertexInfo>& path, Scene const& scene, PathType type) {
+    void BidirectionalIntegrator::generate_path(Ray const& init_ray, std::vector<VertexInfo>& path, Scene const& scene, PathType type, int first_bounce, Intersection const* first_hit) {
         Ray ray = init_ray;
         float3 attenuation = float3::one();
         float accum_pdf = 1.0f;
@@ -163,7 +159,9 @@ namespace tira {
             if (ray.depth == 0) break;
 
             Intersection isect;
-            scene.intersect(ray, isect);
+            if (first_hit) isect = *first_hit;
+            else scene.intersect(ray, isect);
+            first_hit = nullptr;
 
             if (!isect.hit) break;
 
@@ -192,6 +190,7 @@ namespace tira {
 
             // Sample new ray.
             float pdf = 1.0f;
+            start_dimension(first_bounce + init_ray.depth - ray.depth, SampleDimension::BSDF);
             switch (type) {
             case PathType::Camera:
                 v.material->sample(v.wo, v.normal, v.wi, v.tangent, v.bitangent, pdf, ray.is_delta); break;
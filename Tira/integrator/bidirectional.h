@@ -31,13 +31,14 @@ namespace tira {
             Light,
         };
 
-        virtual float3 get_pixel_color(int x, int y, int sample_id, Scene const& scene) override;
+        virtual float3 get_ray_color(Ray& ray, Intersection& primary, Scene const& scene) override;
 
-        void render_paths(Ray const& camera_ray, Ray const& ligth_ray, float3 const& Le, Scene const& scene, std::vector<float>& mis_weights, std::vector<float3>& Ls);
+        void render_paths(int path_id, Ray const& camera_ray, Intersection const& primary, Ray const& ligth_ray, float3 const& Le, Scene const& scene, std::vector<float>& mis_weights, std::vector<float3>& Ls);
         float3 eval_path(Scene const& scene, std::vector<VertexInfo> const& camera_path, std::vector<VertexInfo> const& light_path, float3 const& Le, size_t t, size_t s, float& pdf);
         float geometry_term(float3 const& p0, float3 const& n0, float3 const& p1, float3 const& n1);
 
-        void generate_path(Ray const& init_ray, std::vector<VertexInfo>& path, Scene const& scene, PathType type);
+        // The closest hit of init_ray is intersected unless first_hit is given, vertices sample from bounce dimensions after first_bounce.
+        void generate_path(Ray const& init_ray, std::vector<VertexInfo>& path, Scene const& scene, PathType type, int first_bounce, Intersection const* first_hit = nullptr);
     };
 
 } // namespace tira
@@ -2,77 +2,334 @@
 // Created by Ziyi.Lu 2023/03/20
 //
 
+#include <atomic>
+#include <algorithm>
 #include <integrator/integrator.h>
 
-#define POISSON_POINTS_NUM 32
-
 namespace tira {
 
-    Integrator::Integrator() {
-        poisson_disk = generate_poisson_dist(POISSON_POINTS_NUM);
-    }
-
-    void Integrator::render(Image& image, Scene const& scene, int spp) {
+    int Integrator::render(Image& image, Scene const& scene, int spp, Image* sample_map) {
 
-#ifdef _OPENMP
-        std::cout << "[Tira] OpenMP max threads: " << omp_get_max_threads() << "\n";
+        std::cout << "[Tira] OpenMP max threads: " << get_max_threads() << "\n";
+        std::cout << "[Tira] SPP: " << spp << " Width: " << scene.scr_w << " Height: " << scene.scr_h
+            << " Sampler: " << Sampler::type_name(sampler_type) << "\n";
+        bool progressive = time_budget > 0 || noise_target > 0;
+        if (progressive) {
+            std::cout << "[Tira] Progressive: time budget: " << time_budget << "s, noise target: " << noise_target
+                << ", SPP per pass: " << pass_spp << "\n";
+            if (adaptive_threshold > 0) {
+                std::cout << "[Tira] Progressive rendering takes full passes, adaptive sampling is ignored\n";
+            }
+        }
+        else if (adaptive_threshold > 0) {
+#ifdef RENDER_TILED
+            if (spp < 2) {
+                std::cout << "[Tira] Adaptive sampling needs 2 SPP to estimate errors, all pixels take " << spp << " samples\n";
+            }
+            else {
+                std::cout << "[Tira] Adaptive sampling: threshold: " << adaptive_threshold
+                    << ", min SPP: " << min_spp << ", max SPP: " << max_spp << "\n";
+            }
+#else
+            std::cout << "[Tira] Adaptive sampling needs RENDER_TILED, all pixels take " << spp << " samples\n";
 #endif
-        std::cout << "[Tira] SPP: " << spp << " Width: " << scene.scr_w << " Height: " << scene.scr_h << "\n";
+        }
 
-        ImageFloat buffer(scene.scr_w, scene.scr_h);
+        SampleBuffer samples(scene.scr_w, scene.scr_h);
 
         timer.reset();
-        for (int s = 0; s < spp; ++s) {
-            for (int y = 0; y < image.height; ++y) {
+        if (progressive) {
+            spp = render_progressive(samples, scene, spp);
+        }
+        else {
+#ifdef RENDER_TILED
+            render_tiles(samples, scene, spp, 0, adaptive_threshold > 0);
+#else
+            render_rows(samples, scene, spp);
+#endif
+        }
+        auto elapsed = timer.total_time();
+        std::cout << "\n[Tira] Total time: " << elapsed << "s\n";
+#ifdef ENABLE_TRAVERSAL_STATS
+        scene.accel->stats.print();
+#endif
+#ifdef ENABLE_SHADOW_CACHE
+        scene.shadow_cache.print();
+#endif
+
+        for (int y = 0; y < image.height; ++y) for (int x = 0; x < image.width; ++x) {
+            auto color = samples.mean_at(x, y);
+            // color = reinhard_tone_mapping(color);
+            // color = ACES_tone_mapping(color);
+            color = gamma_correction(color);
+            color = saturate(color);
+            image.set_pixel(x, y, color);
+        }
+
+        if (sample_map) {
+            int min_count = std::numeric_limits<int>::max();
+            int max_count = 1;
+            long long total = 0;
+            for (auto n : samples.counts) {
+                min_count = std::min(min_count, n);
+                max_count = std::max(max_count, n);
+                total += n;
+            }
+            std::cout << "[Tira] Samples per pixel: min: " << min_count << ", max: " << max_count
+                << ", average: " << (double)total / samples.counts.size() << "\n";
+            for (int y = 0; y < sample_map->height; ++y) for (int x = 0; x < sample_map->width; ++x) {
+                sample_map->set_pixel(x, y, colorf((float)samples.count_at(x, y) / max_count));
+            }
+        }
+        return spp;
+    }
+
+    // Tiles are taken by threads of a single parallel region, each renders all samples of its tile.
+    void Integrator::render_tiles(SampleBuffer& samples, Scene const& scene, int spp, int integrated_spp, bool adaptive) {
+        int num_threads = get_max_threads();
+        TileScheduler scheduler(samples.width, samples.height, scene.kernel_info.size, scene.kernel_info.order, num_threads);
+        int tile_count = scheduler.tile_count();
+        if (integrated_spp == 0) {
+            std::cout << "[Tira] Tiles: " << tile_count << " of " << scene.kernel_info.size << "px in "
+                << TileScheduler::order_name(scene.kernel_info.order) << " order\n";
+        }
+
+        std::atomic<int> finished = 0;
 #ifdef _OPENMP
-#pragma omp parallel for
+#pragma omp parallel num_threads(num_threads)
 #endif
-                for (int x = 0; x < image.width; ++x) {
-                    auto color = get_pixel_color(x, y, s, scene);
-                    if (isfinite(color)) {
-                        color = clamp(color, clamp_min, clamp_max);
-                        buffer.increment_pixel(x, y, color);
+        {
+            int thread = get_thread_num();
+            Tile tile;
+            while (scheduler.next(thread, tile)) {
+                if (adaptive) {
+                    render_tile_adaptive(samples, tile, spp, scene);
+                }
+                else {
+                    for (int s = integrated_spp; s < integrated_spp + spp; ++s) {
+                        render_tile(samples, tile, s, scene);
                     }
                 }
+                int n = ++finished;
+                // Only the first thread touches the timer.
+                if (thread == 0) {
+                    timer.update();
+                    print_progress2(n - 1, tile_count, timer.delta_time(), timer.total_time());
+                }
+            }
+#ifdef ENABLE_SHADOW_CACHE
+            scene.shadow_cache.flush_thread();
+#endif
+        }
+        timer.update();
+        print_progress2(tile_count - 1, tile_count, timer.delta_time(), timer.total_time());
+    }
+
+    void Integrator::render_tile(SampleBuffer& samples, Tile const& tile, int sample_id, Scene const& scene) {
+#ifdef RAY_PACKET_SIZE
+        for (int y = tile.y; y < tile.y + tile.h; y += RAY_PACKET_SIZE) {
+            for (int x = tile.x; x < tile.x + tile.w; x += RAY_PACKET_SIZE) {
+                int w = std::min(RAY_PACKET_SIZE, tile.x + tile.w - x);
+                int h = std::min(RAY_PACKET_SIZE, tile.y + tile.h - y);
+                render_packet(samples, x, y, w, h, sample_id, scene);
+            }
+        }
+#else
+        for (int y = tile.y; y < tile.y + tile.h; ++y) {
+            for (int x = tile.x; x < tile.x + tile.w; ++x) {
+                add_sample(samples, x, y, get_pixel_color(x, y, sample_id, scene));
+            }
+        }
+#endif
+    }
+
+    /**
+     * All pixels of the tile take min_spp samples, at least 2 and at most spp, then each pass gives one more sample to the pixels whose relative
+     * error is still above the threshold and that are below max_spp. The error of a pixel is the largest one around
+     * it, so that a pixel whose few samples happen to agree, say next to the edge of a light, is not taken as
+     * converged while its neighbors are still noisy. Passes go on until the tile has spent spp samples per pixel
+     * on average. The budget freed by converged pixels thus goes to the noisy ones of the same tile, and once it runs
+     * short the noisiest pixels of the pass go first. Decisions only depend on the tile, so results do not depend on
+     * the thread count.
+     */
+    void Integrator::render_tile_adaptive(SampleBuffer& samples, Tile const& tile, int spp, Scene const& scene) {
+        // Errors need 2 samples, the budget is never exceeded though.
+        int first_spp = std::min(std::max(min_spp, 2), spp);
+        for (int s = 0; s < first_spp; ++s) {
+            render_tile(samples, tile, s, scene);
+        }
+
+        long long budget = (long long)(spp - first_spp) * tile.w * tile.h;
+        thread_local std::vector<float> errors;
+        thread_local std::vector<std::pair<float, int2>> active;
+        while (budget > 0) {
+            active.clear();
+            errors.resize(tile.w * tile.h);
+            for (int y = 0; y < tile.h; ++y) {
+                for (int x = 0; x < tile.w; ++x) {
+                    errors[x + y * tile.w] = samples.relative_error_at(tile.x + x, tile.y + y);
+                }
             }
+            for (int y = 0; y < tile.h; ++y) {
+                for (int x = 0; x < tile.w; ++x) {
+                    if (samples.count_at(tile.x + x, tile.y + y) >= max_spp) continue;
+                    float error = 0;
+                    for (int j = std::max(y - 1, 0); j <= std::min(y + 1, tile.h - 1); ++j) {
+                        for (int i = std::max(x - 1, 0); i <= std::min(x + 1, tile.w - 1); ++i) {
+                            error = std::max(error, errors[i + j * tile.w]);
+                        }
+                    }
+                    if (error > adaptive_threshold) active.push_back({ error, int2(tile.x + x, tile.y + y) });
+                }
+            }
+            if (active.empty()) break;
+            if ((long long)active.size() > budget) {
+                std::partial_sort(active.begin(), active.begin() + budget, active.end(),
+                    [](auto const& a, auto const& b) { return a.first > b.first; });
+                active.resize(budget);
+            }
+
+            for (auto const& [error, p] : active) {
+                add_sample(samples, p.x, p.y, get_pixel_color(p.x, p.y, samples.count_at(p.x, p.y), scene));
+            }
+            budget -= active.size();
+        }
+    }
+
+    // Forks a parallel region per row of each sample.
+    void Integrator::render_rows(SampleBuffer& samples, Scene const& scene, int spp) {
+        for (int s = 0; s < spp; ++s) {
+            render_N_samples(samples, scene, 1, s);
             timer.update();
             print_progress2(s, spp, timer.delta_time(), timer.total_time());
         }
         print_progress2(spp - 1, spp, timer.delta_time(), timer.total_time());
-        auto elapsed = timer.total_time();
-        std::cout << "\n[Tira] Total time: " << elapsed << "s\n";
+    }
 
-        for (int y = 0; y < image.height; ++y) for (int x = 0; x < image.width; ++x) {
-            auto color = buffer.color_at(x, y);
-            // color = reinhard_tone_mapping(color / spp);
-            // color = ACES_tone_mapping(color / spp);
-            color = gamma_correction(color / spp);
-            color = saturate(color);
-            image.set_pixel(x, y, color);
+    /**
+     * Adds passes of pass_spp samples until spp samples are taken, the time budget is spent or the average relative
+     * error of the pixels is below the noise target. A pass only starts if it should end within the time budget,
+     * judging by the previous one. Passes are rendered by tiles with RENDER_TILED, by rows otherwise.
+     */
+    int Integrator::render_progressive(SampleBuffer& samples, Scene const& scene, int spp) {
+        int integrated_spp = 0;
+        int pass = 0;
+        Timer pass_timer;
+        double pass_time = 0;
+        while (integrated_spp < spp) {
+            if (time_budget > 0 && pass > 0 && timer.total_time() + pass_time > time_budget) break;
+
+            int n = std::min(std::max(pass_spp, 1), spp - integrated_spp);
+            pass_timer.reset();
+#ifdef RENDER_TILED
+            render_tiles(samples, scene, n, integrated_spp);
+#else
+            render_N_samples(samples, scene, n, integrated_spp);
+#endif
+            pass_timer.update();
+            pass_time = pass_timer.delta_time();
+            integrated_spp += n;
+            ++pass;
+            timer.update();
+
+            float noise = samples.relative_error();
+            std::cout << "\n[Tira] Pass " << pass << ": SPP: " << integrated_spp << ", noise: " << noise
+                << ", time: " << timer.total_time() << "s\n" << std::flush;
+            if (noise_target > 0 && noise <= noise_target) break;
+        }
+        return integrated_spp;
+    }
+
+    Sampler& Integrator::get_sampler() const {
+        thread_local IndependentSampler independent;
+        thread_local SobolSampler sobol;
+        thread_local HaltonSampler halton;
+        switch (sampler_type) {
+        case SamplerType::Independent: return independent;
+        case SamplerType::Halton: return halton;
+        default: return sobol;
+        }
+    }
+
+    void Integrator::start_dimension(int depth, int offset) const {
+        get_sampler().start_dimension(SampleDimension::bounce(depth, offset));
+    }
+
+    // Also starts the sample sequence of the pixel sample, the rest of its path draws from it.
+    Ray Integrator::get_camera_ray(int x, int y, int sample_id, Scene const& scene) {
+        auto& sampler = get_sampler();
+        sampler.start_pixel_sample(x, y, sample_id);
+        sample_source = &sampler;
+
+        sampler.start_dimension(SampleDimension::Pixel);
+        auto u0 = random_float2() - .5f;
+        sampler.start_dimension(SampleDimension::Lens);
+        auto u1 = concentric_sample_dist(random_float2());
+        return scene.camera.get_ray(x, y, scene.scr_w, scene.scr_h, u0, u1);
+    }
+
+    float3 Integrator::get_pixel_color(int x, int y, int sample_id, Scene const& scene) {
+        auto ray = get_camera_ray(x, y, sample_id, scene);
+        Intersection isect;
+        scene.intersect(ray, isect);
+        return get_ray_color(ray, isect, scene);
+    }
+
+    void Integrator::add_sample(SampleBuffer& samples, int x, int y, float3 color) const {
+        color = isfinite(color) ? clamp(color, clamp_min, clamp_max) : float3();
+        samples.add_sample(x, y, color);
+    }
+
+    void Integrator::render_packet(SampleBuffer& samples, int x0, int y0, int w, int h, int sample_id, Scene const& scene) {
+        thread_local std::vector<Ray> rays;
+        thread_local std::vector<Intersection> isects;
+        rays.clear();
+        for (int y = y0; y < y0 + h; ++y) {
+            for (int x = x0; x < x0 + w; ++x) {
+                rays.push_back(get_camera_ray(x, y, sample_id, scene));
+            }
+        }
+        isects.assign(rays.size(), Intersection());
+        scene.intersect_packet(rays.data(), isects.data(), rays.size());
+
+        // The sampler was left on the last camera ray, each path goes back to the sequence of its own pixel.
+        auto& sampler = get_sampler();
+        for (int i = 0; i < (int)rays.size(); ++i) {
+            sampler.start_pixel_sample(x0 + i % w, y0 + i / w, sample_id);
+            add_sample(samples, x0 + i % w, y0 + i / w, get_ray_color(rays[i], isects[i], scene));
         }
     }
 
-    void Integrator::render_N_samples(ImageFloat& image, Scene const& scene, int spp, int integrated_spp) {
-        for (int y = 0; y < image.height; ++y) {
+    void Integrator::render_N_samples(SampleBuffer& samples, Scene const& scene, int spp, int integrated_spp) {
+        for (int s = integrated_spp; s < integrated_spp + spp; ++s) {
+#ifdef RAY_PACKET_SIZE
+            for (int y = 0; y < samples.height; y += RAY_PACKET_SIZE) {
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
-            for (int x = 0; x < image.width; ++x) {
-                colorf color;
-                for (int s = 0; s < spp; ++s) {
-                    auto c = get_pixel_color(x, y, s, scene);
-                    if (isfinite(c)) {
-                        c = clamp(c, clamp_min, clamp_max);
-                        color += c;
-                    }
+                for (int x = 0; x < samples.width; x += RAY_PACKET_SIZE) {
+                    int w = std::min(RAY_PACKET_SIZE, samples.width - x);
+                    int h = std::min(RAY_PACKET_SIZE, samples.height - y);
+                    render_packet(samples, x, y, w, h, s, scene);
+                }
+            }
+#else
+            for (int y = 0; y < samples.height; ++y) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+                for (int x = 0; x < samples.width; ++x) {
+                    add_sample(samples, x, y, get_pixel_color(x, y, s, scene));
                 }
-                color = color / spp;
-
-                auto color_prev = image.color_at(x, y);
-                float alpha = (float)spp / (spp + integrated_spp);
-                color = color_prev * (1 - alpha) + color * alpha;
-                image.set_pixel(x, y, color);
             }
+#endif
         }
+#ifdef ENABLE_SHADOW_CACHE
+        // The team of the loops above flushes its shadow cache counters.
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        scene.shadow_cache.flush_thread();
+#endif
     }
 } // namespace tira
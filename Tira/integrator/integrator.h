@@ -7,12 +7,13 @@
 
 #include <scene/scene.h>
 #include <misc/timer.h>
+#include <misc/sampler.h>
 
 namespace tira {
 
     struct Integrator {
         Timer timer;
-        std::vector<float2> poisson_disk;
+        SamplerType sampler_type = SamplerType::Sobol;
 
         int max_depth = 8;
         bool use_mis = true;
@@ -20,12 +21,42 @@ namespace tira {
         float clamp_min = 0.0f;
         float clamp_max = 1.0f;
 
-        Integrator();
+        // Adaptive sampling with RENDER_TILED, disabled while the threshold is 0, see Scene::IntegratorInfo::Adaptive.
+        float adaptive_threshold = 0.0f;
+        int min_spp = 16;
+        int max_spp = 1024;
 
-        void render(Image& image, Scene const& scene, int spp = 64);
-        void render_N_samples(ImageFloat& image, Scene const& scene, int spp = 64, int integrated_spp = 0);
+        // Progressive rendering, disabled while both are 0, see Scene::IntegratorInfo::Progressive.
+        float time_budget = 0.0f;
+        float noise_target = 0.0f;
+        int pass_spp = 1;
 
-        virtual float3 get_pixel_color(int x, int y, int sample_id, Scene const& scene) = 0;
+        // The sample count of each pixel goes to sample_map if given, scaled to the largest one.
+        // Returns the samples per pixel taken, which a progressive render may end below spp.
+        int render(Image& image, Scene const& scene, int spp = 64, Image* sample_map = nullptr);
+        // Adds spp samples to every pixel, numbered after the integrated_spp ones so that the sample sequences go on.
+        void render_N_samples(SampleBuffer& samples, Scene const& scene, int spp = 64, int integrated_spp = 0);
+        int render_progressive(SampleBuffer& samples, Scene const& scene, int spp);
+
+        // Sampler of the calling thread, also the source of its random_float during rendering.
+        Sampler& get_sampler() const;
+        // Moves the sampler of the calling thread to a decision of the bounce at depth, see SampleDimension.
+        void start_dimension(int depth, int offset) const;
+
+        Ray get_camera_ray(int x, int y, int sample_id, Scene const& scene);
+        float3 get_pixel_color(int x, int y, int sample_id, Scene const& scene);
+        // Non-finite colors count as black samples.
+        void add_sample(SampleBuffer& samples, int x, int y, float3 color) const;
+        // Accumulates one sample of the pixels of a block, whose camera rays are intersected as a packet.
+        void render_packet(SampleBuffer& samples, int x0, int y0, int w, int h, int sample_id, Scene const& scene);
+        void render_tile(SampleBuffer& samples, Tile const& tile, int sample_id, Scene const& scene);
+        void render_tile_adaptive(SampleBuffer& samples, Tile const& tile, int spp, Scene const& scene);
+        // Renders samples numbered from integrated_spp, or spp samples per pixel on average with adaptive sampling.
+        void render_tiles(SampleBuffer& samples, Scene const& scene, int spp, int integrated_spp = 0, bool adaptive = false);
+        void render_rows(SampleBuffer& samples, Scene const& scene, int spp);
+
+        // Color carried by a camera ray, isect is its closest hit with surface attributes.
+        virtual float3 get_ray_color(Ray& ray, Intersection& isect, Scene const& scene) = 0;
     };
 
 } // namespace tira
@@ -4,20 +4,13 @@
 
 #include <integrator/montecarlo.h>
 
-#define POISSON_POINTS_NUM 32
-
 namespace tira {
 
-    float3 MonteCarloIntegrator::get_pixel_color(int x, int y, int sample_id, Scene const& scene) {
+    float3 MonteCarloIntegrator::get_ray_color(Ray& ray, Intersection& primary, Scene const& scene) {
 
         float3 L = float3::zero();
         float3 attenuation = float3::one();
 
-        auto const& u0 = poisson_disk[sample_id % POISSON_POINTS_NUM];
-        auto const& u1 = concentric_sample_dist(random_float2());
-
-        auto ray = scene.camera.get_ray(x, y, scene.scr_w, scene.scr_h, u0, u1);
-
         int depth = 0;
 #ifdef USE_RUSSIAN_ROULETTE
         while (true) {
@@ -25,7 +18,8 @@ namespace tira {
         while (depth < max_depth) {
 #endif
             Intersection isect;
-            scene.intersect(ray, isect);
+            if (depth == 0) isect = primary;
+            else scene.intersect(ray, isect);
 
             if (!isect.hit) {
                 if (scene.sun_enabled && scene.hit_sun(ray.direction)) {
@@ -49,6 +43,7 @@ namespace tira {
             float pdf = 0.f;
 
             if (isect.material->is_delta) {
+                start_dimension(depth, SampleDimension::BSDF);
                 isect.material->sample(-ray.direction, isect.normal, wi, isect.tangent, isect.bitangent, pdf, ray.is_delta);
                 attenuation = attenuation * isect.material->eval(-ray.direction, wi, isect.normal, isect.uv, isect.tangent, isect.bitangent);
 
@@ -61,23 +56,34 @@ namespace tira {
             }
 
 #ifdef USE_RUSSIAN_ROULETTE
+            start_dimension(depth, SampleDimension::RussianRoulette);
             float rnd = random_float();
             if (rnd > RUSSIAN_ROULETTE) break;
 
-            if (scene.lights_total_area > 0)
+            if (scene.lights_total_area > 0) {
+                start_dimension(depth, SampleDimension::AreaLight);
                 L += attenuation * calculate_direct_light(LightType::AreaLights, scene, ray, isect, wi, f, pdf, ray.is_delta) / RUSSIAN_ROULETTE;
-            if (scene.sun_enabled)
+            }
+            if (scene.sun_enabled) {
+                start_dimension(depth, SampleDimension::SunLight);
                 L += attenuation * calculate_direct_light(LightType::SunLight, scene, ray, isect, wi, f, pdf, ray.is_delta) / RUSSIAN_ROULETTE;
+            }
             if (scene.lights_total_area <= 0 && !scene.sun_enabled) {
+                start_dimension(depth, SampleDimension::BSDF);
                 isect.material->sample(-ray.direction, isect.normal, wi, isect.tangent, isect.bitangent, pdf, ray.is_delta);
                 f = isect.material->eval(-ray.direction, wi, isect.normal, isect.uv, isect.tangent, isect.bitangent) * std::abs(dot(wi, isect.normal)) / RUSSIAN_ROULETTE;
             }
 #else
-            if (scene.lights_total_area > 0)
+            if (scene.lights_total_area > 0) {
+                start_dimension(depth, SampleDimension::AreaLight);
                 L += attenuation * calculate_direct_light(LightType::AreaLights, scene, ray, isect, wi, f, pdf, ray.is_delta);
-            if (scene.sun_enabled)
+            }
+            if (scene.sun_enabled) {
+                start_dimension(depth, SampleDimension::SunLight);
                 L += attenuation * calculate_direct_light(LightType::SunLight, scene, ray, isect, wi, f, pdf, ray.is_delta);
+            }
             if (scene.envmap) {
+                start_dimension(depth, SampleDimension::Envmap);
                 L += attenuation * calculate_direct_light(LightType::Envmap, scene, ray, isect, wi, f, pdf, ray.is_delta);
             }
 #endif
@@ -188,11 +194,11 @@ namespace tira {
                 {
                     Intersection isect;
                     Ray ray(P, wi);
-                    ray.shadow_ray = true;
-                    scene.intersect(ray, isect);
                     is_black = true;
                     switch (type) {
                     case LightType::AreaLights:
+                        // Needs the closest hit with its normal to tell whether the light is reached.
+                        scene.intersect(ray, isect);
                         if (isect.hit && isect.material->emissive && dot(wi, isect.normal) < 0) {
                             if (!scene.directional_area_light || dot(wi, -isect.normal) > (1.0 - scene.directional_area_light_solid_angle))
                                 Li = isect.material->emission;
@@ -201,14 +207,14 @@ namespace tira {
                         }
                         break;
                     case LightType::SunLight:
-                        if (!isect.hit && scene.hit_sun(wi)) {
+                        if (scene.hit_sun(wi) && !scene.occluded(ray, FLOAT_MAX, scene.sun_light_id())) {
                             light_pdf = 1 / scene.sun_solid_angle;
                             Li = scene.sun_radiance;
                             is_black = false;
                         }
                         break;
                     case LightType::Envmap:
-                        if (!isect.hit) {
+                        if (!scene.occluded(ray, FLOAT_MAX, scene.envmap_light_id())) {
                             light_pdf = INV_TWO_PI;
                             Li = scene.envmap->sample(wi) * scene.envmap_scale;
                             is_black = false;
@@ -23,7 +23,7 @@ namespace tira {
 
         LightPathOption path_option = LightPathOption::MaxDepth;
 
-        virtual float3 get_pixel_color(int x, int y, int sample_id, Scene const& scene) override;
+        virtual float3 get_ray_color(Ray& ray, Intersection& primary, Scene const& scene) override;
         float3 calculate_direct_light(LightType type, Scene const& scene, Ray const& ray, Intersection const& isect, float3& wi, float3& bsdf, float& pdf, bool& is_delta);
     };
 
@@ -6,16 +6,11 @@
 
 namespace tira {
 
-    float3 WhittedIntegrator::get_pixel_color(int x, int y, int sample_id, Scene const& scene) {
+    float3 WhittedIntegrator::get_ray_color(Ray& ray, Intersection& isect, Scene const& scene) {
         float3 L = float3::zero();
         float3 attenuation = float3::one();
 
-        auto const& u0 = poisson_disk[sample_id % POISSON_POINTS_NUM];
-        auto const& u1 = concentric_sample_dist(random_float2());
-
-        auto ray = scene.camera.get_ray(x, y, scene.scr_w, scene.scr_h, u0, u1);
-
-        Intersection isect, light_isect;
+        Intersection light_isect;
         float3 Li;
         float3 wi, wo, f;
         float pdf;
@@ -23,7 +18,8 @@ namespace tira {
         bool is_black;
 
         for (int depth = 0; depth < max_depth; ++depth) {
-            scene.intersect(ray, isect);
+            // The closest hit of the camera ray is given.
+            if (depth > 0) scene.intersect(ray, isect);
 
             if (!isect.hit) {
                 if (scene.sun_enabled && scene.hit_sun(ray.direction)) {
@@ -38,6 +34,7 @@ namespace tira {
             wo = -ray.direction;
 
             if (isect.material->is_delta) {
+                start_dimension(depth, SampleDimension::BSDF);
                 isect.material->sample(wo, isect.normal, wi, isect.tangent, isect.bitangent, pdf, ray.is_delta);
                 attenuation = attenuation * isect.material->eval(wo, wi, isect.normal, isect.uv, isect.tangent, isect.bitangent);
 
@@ -54,6 +51,7 @@ namespace tira {
             }
 
             if (scene.lights_total_area > 0) {
+                start_dimension(depth, SampleDimension::AreaLight);
                 scene.sample_light(isect.position, light_isect, wi, pdf, visibility);
                 Li = light_isect.material->emission;
                 is_black = dot(Li, Li) < EPSILON;
@@ -64,6 +62,7 @@ namespace tira {
             }
 
             if (scene.sun_enabled) {
+                start_dimension(depth, SampleDimension::SunLight);
                 Li = scene.sample_sun(isect.position, isect.normal, wi, pdf, visibility);
                 is_black = dot(Li, Li) < EPSILON;
                 if (!is_black && pdf > EPSILON) {
@@ -73,6 +72,7 @@ namespace tira {
             }
 
             if (scene.envmap) {
+                start_dimension(depth, SampleDimension::Envmap);
                 Li = scene.sample_envmap(isect.position, isect.normal, wi, pdf, visibility) * scene.envmap_scale;
                 is_black = dot(Li, Li) < EPSILON;
                 if (!is_black && pdf > EPSILON) {
@@ -81,6 +81,7 @@ namespace tira {
                 }
             }
 
+            start_dimension(depth, SampleDimension::BSDF);
             isect.material->sample(wo, isect.normal, wi, isect.tangent, isect.bitangent, pdf, ray.is_delta);
             f = isect.material->eval(wo, wi, isect.normal, isect.uv, isect.tangent, isect.bitangent);
             if (!ray.is_delta) {
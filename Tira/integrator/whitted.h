@@ -10,7 +10,7 @@
 namespace tira {
 
     struct WhittedIntegrator : Integrator {
-        virtual float3 get_pixel_color(int x, int y, int sample_id, Scene const& scene) override;
+        virtual float3 get_ray_color(Ray& ray, Intersection& isect, Scene const& scene) override;
     };
 
 } // namespace tira
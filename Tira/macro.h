@@ -42,13 +42,97 @@
 // V 
 #define SAH_MAX_SEARCH 256
 
+// ┌─ Bin count for binned SAH subdivide
+// V 
+#define SAH_BINS 32
+
+// ┌─ Min overlap of object split children, relative to root area, to try a spatial split in SBVH build
+// V 
+#define SBVH_ALPHA 1e-5f
+
+// ┌─ Max extra references created by spatial splits in SBVH build, relative to object count
+// V 
+#define SBVH_DUPLICATION_BUDGET 0.3f
+
+// ┌─ Search radius of nearest cluster in PLOC build
+// V 
+#define PLOC_RADIUS 16
+
+// ┌─ Max passes of treelet restructuring when BVH optimization is enabled
+// V 
+#define BVH_OPTIMIZE_PASSES 3
+
+// ┌─ Rebuild BVH instead of refitting it when SAH cost grows by this factor over the built tree
+// V 
+#define BVH_REFIT_REBUILD_RATIO 1.5f
+
+// ┌─ Cells per object of grid accelerator
+// V 
+#define GRID_DENSITY 4.f
+
+// ┌─ Max cells along an axis of grid accelerator
+// V 
+#define GRID_MAX_RESOLUTION 512
+
+// ┌─ Nest grids in the cells of grid accelerator that hold too many objects
+// V 
+#define GRID_TWO_LEVEL
+
+// ┌─ Max objects in a grid cell before it gets a nested grid
+// V 
+#define GRID_MAX_CELL_OBJECTS 16
+
+// ┌─ Entries of per-thread mailbox that keeps grid traversal from testing an object twice
+// V 
+#define GRID_MAILBOX_SIZE 64
+
 // ┌─ Traverse BVH iteratively rather than recursively
 // V 
 #define TRAVERSE_ITERATIVE
 
 // ┌─ Traverse BVH iteratively with stack, or traverse with pointers
 // V 
-// #define TRAVERSE_ITERATIVE_STACK
+#define TRAVERSE_ITERATIVE_STACK
+
+// ┌─ Traverse BVH with pointers front-to-back using parent links, takes effect with TRAVERSE_ITERATIVE_STACK commented out
+// V 
+// #define TRAVERSE_ORDERED
+
+// ┌─ Store BVH triangles and spheres in typed arrays to avoid virtual calls in leaves
+// V 
+#define BVH_TYPED_PRIMITIVES
+
+// ┌─ Copy BVH nodes into 32-byte nodes in depth-first order and leaf primitives in leaf order for traversal
+// V 
+#define BVH_COMPACT_LAYOUT
+
+// ┌─ Render all samples of a tile while it is cache-hot, tiles are scheduled with work stealing, rather than row by row per sample
+// V 
+#define RENDER_TILED
+
+// ┌─ Intersect camera rays of square blocks of pixels as packets, comment out to trace them one by one
+// V 
+#define RAY_PACKET_SIZE 8
+
+// ┌─ Pack triangles in leaves of wide BVH to intersect them with SIMD
+// V 
+#define WBVH_PACKED_TRIANGLES
+
+// ┌─ Count node visits and primitive tests per ray, printed after rendering
+// V 
+// #define ENABLE_TRAVERSAL_STATS
+
+// ┌─ Cache the last occluder of shadow rays per thread, light and cell, tested before traversing the scene
+// V 
+#define ENABLE_SHADOW_CACHE
+
+// ┌─ Cells of the shadow cache along the longest axis of the scene
+// V 
+#define SHADOW_CACHE_RESOLUTION 64
+
+// ┌─ Entries of the per-thread shadow cache
+// V 
+#define SHADOW_CACHE_SIZE 4096
 
 // ┌─ Threshold of Ni for BlinnPhongMaterial's specular term to become a delta function
 // V 
@@ -66,10 +150,6 @@
 //  -3 ver.3
 #define INTEGRATOR_VER 2
 
-// ┌─ How many poisson points used for sampling eye direction
-// V 
-#define POISSON_POINTS_NUM 32
-
 //// Macros for developers, do not modify if unsure of its usage
 
 // Ver.1
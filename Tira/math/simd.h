@@ -5,13 +5,132 @@
 #ifndef SIMD_H
 #define SIMD_H
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SIMD_SSE
 #include <xmmintrin.h>
+#endif
+#if defined(__AVX__)
+#define SIMD_AVX
+#include <immintrin.h>
+#endif
 
 namespace tira {
 
+#ifdef SIMD_SSE
     inline float _access_m128f(__m128 const* m, size_t idx) {
         return ((float*)m)[idx];
     }
+#endif
+
+    /**
+     * N floats processed together, used by SoA kernels such as wide BVH traversal.
+     * 4 lanes map to SSE and 8 lanes to AVX when available, otherwise lanes are processed in a loop.
+     * Comparisons return a bit mask with bit i set if lane i passes.
+     * vmin/vmax return the second operand if either one is NaN, same as SSE.
+     */
+    template <int N>
+    struct vfloat {
+        float v[N];
+
+        vfloat() {}
+        vfloat(float s) { for (int i = 0; i < N; ++i) v[i] = s; }
+
+        static vfloat load(float const* p) {
+            vfloat r;
+            for (int i = 0; i < N; ++i) r.v[i] = p[i];
+            return r;
+        }
+        void store(float* p) const { for (int i = 0; i < N; ++i) p[i] = v[i]; }
+
+        friend vfloat operator+(vfloat const& a, vfloat const& b) { vfloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+        friend vfloat operator-(vfloat const& a, vfloat const& b) { vfloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+        friend vfloat operator*(vfloat const& a, vfloat const& b) { vfloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+        friend vfloat operator/(vfloat const& a, vfloat const& b) { vfloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] / b.v[i]; return r; }
+        friend vfloat vmin(vfloat const& a, vfloat const& b) { vfloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; }
+        friend vfloat vmax(vfloat const& a, vfloat const& b) { vfloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+
+        friend int operator<(vfloat const& a, vfloat const& b) { int m = 0; for (int i = 0; i < N; ++i) m |= (a.v[i] < b.v[i]) << i; return m; }
+        friend int operator<=(vfloat const& a, vfloat const& b) { int m = 0; for (int i = 0; i < N; ++i) m |= (a.v[i] <= b.v[i]) << i; return m; }
+        friend int operator>(vfloat const& a, vfloat const& b) { return b < a; }
+        friend int operator>=(vfloat const& a, vfloat const& b) { return b <= a; }
+    };
+
+#ifdef SIMD_SSE
+    template <>
+    struct vfloat<4> {
+        __m128 m;
+
+        vfloat() {}
+        vfloat(float s) : m(_mm_set1_ps(s)) {}
+        vfloat(__m128 _m) : m(_m) {}
+
+        static vfloat load(float const* p) { return _mm_loadu_ps(p); }
+        void store(float* p) const { _mm_storeu_ps(p, m); }
+
+        friend vfloat operator+(vfloat const& a, vfloat const& b) { return _mm_add_ps(a.m, b.m); }
+        friend vfloat operator-(vfloat const& a, vfloat const& b) { return _mm_sub_ps(a.m, b.m); }
+        friend vfloat operator*(vfloat const& a, vfloat const& b) { return _mm_mul_ps(a.m, b.m); }
+        friend vfloat operator/(vfloat const& a, vfloat const& b) { return _mm_div_ps(a.m, b.m); }
+        friend vfloat vmin(vfloat const& a, vfloat const& b) { return _mm_min_ps(a.m, b.m); }
+        friend vfloat vmax(vfloat const& a, vfloat const& b) { return _mm_max_ps(a.m, b.m); }
+
+        friend int operator<(vfloat const& a, vfloat const& b) { return _mm_movemask_ps(_mm_cmplt_ps(a.m, b.m)); }
+        friend int operator<=(vfloat const& a, vfloat const& b) { return _mm_movemask_ps(_mm_cmple_ps(a.m, b.m)); }
+        friend int operator>(vfloat const& a, vfloat const& b) { return _mm_movemask_ps(_mm_cmplt_ps(b.m, a.m)); }
+        friend int operator>=(vfloat const& a, vfloat const& b) { return _mm_movemask_ps(_mm_cmple_ps(b.m, a.m)); }
+    };
+#endif
+
+#ifdef SIMD_AVX
+    template <>
+    struct vfloat<8> {
+        __m256 m;
+
+        vfloat() {}
+        vfloat(float s) : m(_mm256_set1_ps(s)) {}
+        vfloat(__m256 _m) : m(_m) {}
+
+        static vfloat load(float const* p) { return _mm256_loadu_ps(p); }
+        void store(float* p) const { _mm256_storeu_ps(p, m); }
+
+        friend vfloat operator+(vfloat const& a, vfloat const& b) { return _mm256_add_ps(a.m, b.m); }
+        friend vfloat operator-(vfloat const& a, vfloat const& b) { return _mm256_sub_ps(a.m, b.m); }
+        friend vfloat operator*(vfloat const& a, vfloat const& b) { return _mm256_mul_ps(a.m, b.m); }
+        friend vfloat operator/(vfloat const& a, vfloat const& b) { return _mm256_div_ps(a.m, b.m); }
+        friend vfloat vmin(vfloat const& a, vfloat const& b) { return _mm256_min_ps(a.m, b.m); }
+        friend vfloat vmax(vfloat const& a, vfloat const& b) { return _mm256_max_ps(a.m, b.m); }
+
+        friend int operator<(vfloat const& a, vfloat const& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ)); }
+        friend int operator<=(vfloat const& a, vfloat const& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ)); }
+        friend int operator>(vfloat const& a, vfloat const& b) { return _mm256_movemask_ps(_mm256_cmp_ps(b.m, a.m, _CMP_LT_OQ)); }
+        friend int operator>=(vfloat const& a, vfloat const& b) { return _mm256_movemask_ps(_mm256_cmp_ps(b.m, a.m, _CMP_LE_OQ)); }
+    };
+#elif defined(SIMD_SSE)
+    // Two SSE halves when AVX is not enabled at compile time.
+    template <>
+    struct vfloat<8> {
+        vfloat<4> lo, hi;
+
+        vfloat() {}
+        vfloat(float s) : lo(s), hi(s) {}
+        vfloat(vfloat<4> const& _lo, vfloat<4> const& _hi) : lo(_lo), hi(_hi) {}
+
+        static vfloat load(float const* p) { return { vfloat<4>::load(p), vfloat<4>::load(p + 4) }; }
+        void store(float* p) const { lo.store(p); hi.store(p + 4); }
+
+        friend vfloat operator+(vfloat const& a, vfloat const& b) { return { a.lo + b.lo, a.hi + b.hi }; }
+        friend vfloat operator-(vfloat const& a, vfloat const& b) { return { a.lo - b.lo, a.hi - b.hi }; }
+        friend vfloat operator*(vfloat const& a, vfloat const& b) { return { a.lo * b.lo, a.hi * b.hi }; }
+        friend vfloat operator/(vfloat const& a, vfloat const& b) { return { a.lo / b.lo, a.hi / b.hi }; }
+        friend vfloat vmin(vfloat const& a, vfloat const& b) { return { vmin(a.lo, b.lo), vmin(a.hi, b.hi) }; }
+        friend vfloat vmax(vfloat const& a, vfloat const& b) { return { vmax(a.lo, b.lo), vmax(a.hi, b.hi) }; }
+
+        friend int operator<(vfloat const& a, vfloat const& b) { return (a.lo < b.lo) | ((a.hi < b.hi) << 4); }
+        friend int operator<=(vfloat const& a, vfloat const& b) { return (a.lo <= b.lo) | ((a.hi <= b.hi) << 4); }
+        friend int operator>(vfloat const& a, vfloat const& b) { return (a.lo > b.lo) | ((a.hi > b.hi) << 4); }
+        friend int operator>=(vfloat const& a, vfloat const& b) { return (a.lo >= b.lo) | ((a.hi >= b.hi) << 4); }
+    };
+#endif
 
 } // namespace tira
 
@@ -278,4 +278,50 @@ namespace tira {
         data[offset + 2] += color.b;
     }
 
+    SampleBuffer::SampleBuffer(int w, int h)
+        : sum(w, h)
+        , sum_squared(w, h)
+        , counts(w * h, 0)
+        , width(w)
+        , height(h) {}
+
+    void SampleBuffer::add_sample(int x, int y, colorf const& color) {
+        if (x < 0 || x >= width) return;
+        if (y < 0 || y >= height) return;
+        sum.increment_pixel(x, y, color);
+        sum_squared.increment_pixel(x, y, color * color);
+        ++counts[x + y * width];
+    }
+
+    int SampleBuffer::count_at(int x, int y) const {
+        x = clamp(x, 0, width - 1);
+        y = clamp(y, 0, height - 1);
+        return counts[x + y * width];
+    }
+
+    colorf SampleBuffer::mean_at(int x, int y) {
+        int n = count_at(x, y);
+        return n > 0 ? sum.color_at(x, y) / n : colorf();
+    }
+
+    // Black pixels have no error, the small offset keeps dark ones from being sampled forever.
+    float SampleBuffer::relative_error_at(int x, int y) {
+        int n = count_at(x, y);
+        if (n < 2) return std::numeric_limits<float>::max();
+        auto m = sum.color_at(x, y) / n;
+        auto m2 = sum_squared.color_at(x, y) / n;
+        auto variance = colorf::max(m2 - m * m, colorf(0.f)) * ((float)n / (n - 1));
+        float mean = (m.r + m.g + m.b) / 3;
+        float error = std::sqrt((variance.r + variance.g + variance.b) / 3 / n);
+        return error / (mean + 1e-3f);
+    }
+
+    float SampleBuffer::relative_error() {
+        double total = 0;
+        for (int y = 0; y < height; ++y) for (int x = 0; x < width; ++x) {
+            total += relative_error_at(x, y);
+        }
+        return total / (width * height);
+    }
+
 } // namespace tira
@@ -7,6 +7,7 @@
 
 #include <misc/utils.h>
 #include <string>
+#include <vector>
 
 namespace tira {
 
@@ -46,6 +47,27 @@ namespace tira {
         void increment_pixel(int x, int y, colorf const& color, bool flip = true);
     };
 
+    /**
+     * Running sums of the samples of each pixel with their second moments and counts, so that pixels can take
+     * different numbers of samples and report the error of their mean.
+     */
+    struct SampleBuffer {
+        ImageFloat sum;
+        ImageFloat sum_squared;
+        std::vector<int> counts;
+        int width, height;
+
+        SampleBuffer(int w, int h);
+
+        void add_sample(int x, int y, colorf const& color);
+        int count_at(int x, int y) const;
+        colorf mean_at(int x, int y);
+        // Standard error of the mean relative to the mean, both averaged over channels.
+        float relative_error_at(int x, int y);
+        // Average relative error of the pixels, as an estimate of the noise of the image.
+        float relative_error();
+    };
+
 } // namespace tira
 
 #endif
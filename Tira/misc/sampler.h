@@ -0,0 +1,211 @@
+//
+// Created by Ziyi.Lu 2023/04/30
+//
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <vector>
+#include <cstdint>
+#include <misc/utils.h>
+
+namespace tira {
+
+    enum struct SamplerType {
+        Independent,
+        Sobol,
+        Halton,
+    };
+
+    /**
+     * Decisions of a path that start a fixed run of dimensions, so that the same decision of every sample of a pixel
+     * draws from the same dimension of the sequence. A bounce takes BOUNCE_DIMENSIONS dimensions after the camera ones.
+     */
+    struct SampleDimension {
+        static constexpr int Pixel = 0;
+        static constexpr int Lens = 1;
+        static constexpr int BOUNCE_START = 2;
+        static constexpr int BOUNCE_DIMENSIONS = 16;
+
+        // Offsets inside a bounce.
+        static constexpr int RussianRoulette = 0;
+        static constexpr int AreaLight = 1; // Light choice, position, then MIS BSDF sample.
+        static constexpr int SunLight = 5;
+        static constexpr int Envmap = 8;
+        static constexpr int BSDF = 11;
+
+        static int bounce(int depth, int offset) {
+            return BOUNCE_START + depth * BOUNCE_DIMENSIONS + offset;
+        }
+    };
+
+    /**
+     * Sample sequence of one pixel sample. Each draw of random_float or random_float2 takes the next dimension,
+     * integrators move to the dimension of a decision with start_dimension.
+     */
+    struct Sampler : SampleSource {
+        virtual ~Sampler() {}
+
+        void start_pixel_sample(int x, int y, int sample_id) {
+            pixel_seed = hash(uint32_t(x) ^ hash(uint32_t(y)));
+            sample_index = sample_id;
+            dimension = 0;
+        }
+
+        void start_dimension(int d) {
+            dimension = d;
+        }
+
+        static char const* type_name(SamplerType type) {
+            switch (type) {
+            case SamplerType::Independent: return "independent";
+            case SamplerType::Sobol: return "sobol";
+            case SamplerType::Halton: return "halton";
+            }
+            return "";
+        }
+
+    protected:
+        uint32_t pixel_seed = 0;
+        uint32_t sample_index = 0;
+        uint32_t dimension = 0;
+
+        // PCG hash from Jarzynski and Olano, Hash Functions for GPU Rendering.
+        static uint32_t hash(uint32_t v) {
+            uint32_t state = v * 747796405u + 2891336453u;
+            uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+            return (word >> 22u) ^ word;
+        }
+
+        static float to_float(uint32_t v) {
+            return (v >> 8) * 0x1p-24f;
+        }
+    };
+
+    // Uncorrelated numbers hashed from the pixel, sample and dimension.
+    struct IndependentSampler : Sampler {
+        virtual float get_1d() override {
+            RandomState state = { pixel_seed, sample_index, dimension++, 0x9e3779b9u };
+            pcg4d(state);
+            return to_float(state.x);
+        }
+
+        virtual float2 get_2d() override {
+            RandomState state = { pixel_seed, sample_index, dimension++, 0x9e3779b9u };
+            pcg4d(state);
+            return { to_float(state.x), to_float(state.y) };
+        }
+    };
+
+    /**
+     * Owen-scrambled Sobol sequence, padded over dimensions as in Burley, Practical Hash-based Owen Scrambling.
+     * Each dimension takes the first two Sobol dimensions with its own shuffle of the sample index and its own
+     * scrambles, all seeded by the pixel, so that pixels are decorrelated while the samples of one pixel stay stratified.
+     */
+    struct SobolSampler : Sampler {
+        virtual float get_1d() override {
+            uint32_t seed = hash(pixel_seed ^ hash(dimension++));
+            uint32_t index = nested_uniform_scramble(sample_index, seed);
+            return to_float(nested_uniform_scramble(sobol(index, 0), hash(seed ^ 0x5bd1e995u)));
+        }
+
+        virtual float2 get_2d() override {
+            uint32_t seed = hash(pixel_seed ^ hash(dimension++));
+            uint32_t index = nested_uniform_scramble(sample_index, seed);
+            return {
+                to_float(nested_uniform_scramble(sobol(index, 0), hash(seed ^ 0x5bd1e995u))),
+                to_float(nested_uniform_scramble(sobol(index, 1), hash(seed ^ 0x68e31da4u))),
+            };
+        }
+
+    private:
+        // Generator matrices of the first two Sobol dimensions: bit reversal, and the Pascal matrix modulo 2.
+        static uint32_t sobol(uint32_t index, int d) {
+            uint32_t x = 0;
+            uint32_t v = 0x80000000u;
+            for (; index; index >>= 1) {
+                if (index & 1) x ^= v;
+                v = d == 0 ? v >> 1 : v ^ (v >> 1);
+            }
+            return x;
+        }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+            x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+            x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+            x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+            return x;
+        }
+
+        // Permutes the bits of x in reversed order, each bit is flipped by a hash of the higher ones.
+        static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+            x ^= x * 0x3d20adeau;
+            x += seed;
+            x *= (seed >> 16) | 1;
+            x ^= x * 0x05526c56u;
+            x ^= x * 0x53a22864u;
+            return x;
+        }
+
+        static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+            return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+        }
+    };
+
+    /**
+     * Halton sequence with a prime base per dimension. Each digit goes through a random linear permutation hashed
+     * from the pixel, dimension and digit position, which decorrelates pixels and breaks up the correlation between
+     * the large bases. Bases repeat past HALTON_DIMENSIONS draws, with other permutations.
+     */
+    struct HaltonSampler : Sampler {
+        static constexpr int HALTON_DIMENSIONS = 128;
+
+        virtual float get_1d() override {
+            uint32_t d = dimension++;
+            return sample(d % HALTON_DIMENSIONS * 2, d * 2);
+        }
+
+        virtual float2 get_2d() override {
+            uint32_t d = dimension++;
+            return { sample(d % HALTON_DIMENSIONS * 2, d * 2), sample(d % HALTON_DIMENSIONS * 2 + 1, d * 2 + 1) };
+        }
+
+    private:
+        // Scrambled radical inverse in the k-th prime base, digits are permuted until they fall below float precision.
+        float sample(uint32_t k, uint32_t key) const {
+            static std::vector<uint32_t> const primes = first_primes(2 * HALTON_DIMENSIONS);
+            uint32_t base = primes[k];
+            double inv_base = 1.0 / base;
+            double f = inv_base;
+            double r = 0.0;
+            uint32_t i = sample_index;
+            for (uint32_t j = 0; f > 1e-8; ++j) {
+                uint32_t h = hash(pixel_seed ^ hash(key * 64 + j));
+                uint32_t a = base > 2 ? 1 + h % (base - 1) : 1;
+                uint32_t c = (h >> 16) % base;
+                r += (uint64_t(a) * (i % base) + c) % base * f;
+                i /= base;
+                f *= inv_base;
+            }
+            return std::min(float(r), 0x1.fffffep-1f);
+        }
+
+        static std::vector<uint32_t> first_primes(int n) {
+            std::vector<uint32_t> primes;
+            for (uint32_t v = 2; (int)primes.size() < n; ++v) {
+                bool is_prime = true;
+                for (auto p : primes) {
+                    if (p * p > v) break;
+                    if (v % p == 0) { is_prime = false; break; }
+                }
+                if (is_prime) primes.push_back(v);
+            }
+            return primes;
+        }
+    };
+
+} // namespace tira
+
+#endif
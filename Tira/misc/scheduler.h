@@ -0,0 +1,139 @@
+//
+// Created by Ziyi.Lu 2023/04/29
+//
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+namespace tira {
+
+    enum struct TileOrder {
+        Scanline,
+        Morton,
+        Spiral, // From the center of the image outward.
+    };
+
+    struct Tile {
+        int x, y;
+        int w, h;
+    };
+
+    /**
+     * Work-stealing scheduler of image tiles. Each thread starts with a contiguous run of the tile order and
+     * takes tiles from its front, a thread that runs out steals from the back of another thread's queue,
+     * so that tiles close in the order mostly stay on the same thread.
+     */
+    struct TileScheduler {
+        TileScheduler(int width, int height, int tile_size, TileOrder order, int num_threads)
+            : queues(std::max(num_threads, 1)) {
+            tile_size = std::max(tile_size, 1);
+            int nx = (width + tile_size - 1) / tile_size;
+            int ny = (height + tile_size - 1) / tile_size;
+            for (int ty = 0; ty < ny; ++ty) {
+                for (int tx = 0; tx < nx; ++tx) {
+                    int x = tx * tile_size;
+                    int y = ty * tile_size;
+                    tiles.push_back({ x, y, std::min(tile_size, width - x), std::min(tile_size, height - y) });
+                }
+            }
+            sort_tiles(nx, ny, tile_size, order);
+
+            int n = tiles.size();
+            int m = queues.size();
+            for (int i = 0; i < m; ++i) {
+                for (int j = n * i / m; j < n * (i + 1) / m; ++j) queues[i].tiles.push_back(j);
+            }
+        }
+
+        int tile_count() const { return tiles.size(); }
+
+        // Next tile for the thread, false once all tiles are taken.
+        bool next(int thread, Tile& tile) {
+            {
+                auto& queue = queues[thread];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.tiles.empty()) {
+                    tile = tiles[queue.tiles.front()];
+                    queue.tiles.pop_front();
+                    return true;
+                }
+            }
+            for (int i = 1; i < (int)queues.size(); ++i) {
+                auto& victim = queues[(thread + i) % queues.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tiles.empty()) {
+                    tile = tiles[victim.tiles.back()];
+                    victim.tiles.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static char const* order_name(TileOrder order) {
+            switch (order) {
+            case TileOrder::Scanline: return "scanline";
+            case TileOrder::Morton: return "morton";
+            case TileOrder::Spiral: return "spiral";
+            }
+            return "";
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<int> tiles;
+        };
+
+        std::vector<Tile> tiles;
+        std::vector<Queue> queues;
+
+        static uint32_t morton_code(uint32_t x, uint32_t y) {
+            auto spread = [](uint32_t v) {
+                v &= 0xffff;
+                v = (v | (v << 8)) & 0x00ff00ff;
+                v = (v | (v << 4)) & 0x0f0f0f0f;
+                v = (v | (v << 2)) & 0x33333333;
+                v = (v | (v << 1)) & 0x55555555;
+                return v;
+            };
+            return spread(x) | (spread(y) << 1);
+        }
+
+        void sort_tiles(int nx, int ny, int tile_size, TileOrder order) {
+            switch (order) {
+            case TileOrder::Scanline:
+                break;
+            case TileOrder::Morton:
+                std::stable_sort(tiles.begin(), tiles.end(), [&](Tile const& a, Tile const& b) {
+                    return morton_code(a.x / tile_size, a.y / tile_size) < morton_code(b.x / tile_size, b.y / tile_size);
+                });
+                break;
+            case TileOrder::Spiral: {
+                // Rings around the center tile, each one walked by angle.
+                float cx = (nx - 1) * .5f;
+                float cy = (ny - 1) * .5f;
+                auto key = [&](Tile const& t) {
+                    float dx = t.x / tile_size - cx;
+                    float dy = t.y / tile_size - cy;
+                    float ring = std::ceil(std::max(std::abs(dx), std::abs(dy)));
+                    return std::make_pair(ring, std::atan2(dy, dx));
+                };
+                std::stable_sort(tiles.begin(), tiles.end(), [&](Tile const& a, Tile const& b) {
+                    return key(a) < key(b);
+                });
+            } break;
+            }
+        }
+    };
+
+} // namespace tira
+
+#endif
@@ -7,7 +7,7 @@
 
 #include <cmath>
 #include <vector>
-#include <random>
+#include <cstdint>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
@@ -52,6 +52,31 @@ if (from_last_fixed > fixed_delta) {                                    \
 
 namespace tira {
 
+    // OpenMP queries that fall back to a single thread when built without OpenMP.
+    inline int get_max_threads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    inline int get_num_threads() {
+#ifdef _OPENMP
+        return omp_get_num_threads();
+#else
+        return 1;
+#endif
+    }
+
+    inline int get_thread_num() {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
     // Convert float value in scene to integer value in image space.
     inline int ftoi(float x) {
         // Difference of (int)std::floor(x) and static_cast<int>(x):
@@ -119,15 +144,44 @@ namespace tira {
         return { i, radicalInverseVDC };
     }
 
-    inline float random_float() {
-        static std::random_device dev;
-        static std::mt19937 rng(dev());
-        std::uniform_real_distribution<float> dist(0.f, 1.f);
+    struct RandomState {
+        uint32_t x, y, z, w;
+    };
+
+    /**
+     * Source of random_float and random_float2 on the calling thread when set. Integrators install a Sampler
+     * of misc/sampler.h per thread, so that materials and lights draw from it without taking samples as parameters.
+     */
+    struct SampleSource {
+        virtual float get_1d() = 0;
+        virtual float2 get_2d() = 0;
+    };
+
+    inline thread_local SampleSource* sample_source = nullptr;
+
+    // Sequence of random_float on the calling thread when no sample source is set.
+    inline thread_local RandomState random_state = { 0x9e3779b9u, 0x7f4a7c15u, 0x85ebca6bu, 0xc2b2ae35u };
+
+    // Counter-based hash from Jarzynski and Olano, Hash Functions for GPU Rendering, same as in Tira_GPU/Shader/rt.comp.
+    inline void pcg4d(RandomState& v) {
+        v.x = v.x * 1664525u + 1013904223u;
+        v.y = v.y * 1664525u + 1013904223u;
+        v.z = v.z * 1664525u + 1013904223u;
+        v.w = v.w * 1664525u + 1013904223u;
+        v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+        v.x ^= v.x >> 16u; v.y ^= v.y >> 16u; v.z ^= v.z >> 16u; v.w ^= v.w >> 16u;
+        v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+    }
 
-        return dist(rng);
+    // Uniform in [0, 1), from the upper 24 bits so that 1 is never returned.
+    inline float random_float() {
+        if (sample_source) return sample_source->get_1d();
+        pcg4d(random_state);
+        return (random_state.x >> 8) * 0x1p-24f;
     }
 
     inline float2 random_float2() {
+        if (sample_source) return sample_source->get_2d();
         return { random_float(), random_float() };
         // return hammersley(random_float());
     }
@@ -8,12 +8,80 @@
 #include <misc/image.h>
 #include <geometry/ray.h>
 #include <geometry/object.h>
+#ifdef ENABLE_TRAVERSAL_STATS
+#include <atomic>
+#include <cstdint>
+#endif
+
+#ifdef ENABLE_TRAVERSAL_STATS
+#define TRAVERSAL_STATS_NODE() (++TraversalStats::local_nodes)
+#define TRAVERSAL_STATS_PRIM() (++TraversalStats::local_prims)
+#define TRAVERSAL_STATS_RAY() (stats.flush())
+#else
+#define TRAVERSAL_STATS_NODE() ((void)0)
+#define TRAVERSAL_STATS_PRIM() ((void)0)
+#define TRAVERSAL_STATS_RAY() ((void)0)
+#endif
 
 namespace tira {
 
+#ifdef ENABLE_TRAVERSAL_STATS
+    // Node visits and primitive tests are counted per thread and flushed once per ray.
+    struct TraversalStats {
+        std::atomic<uint64_t> rays = 0;
+        std::atomic<uint64_t> nodes = 0;
+        std::atomic<uint64_t> prims = 0;
+
+        inline static thread_local uint64_t local_nodes = 0;
+        inline static thread_local uint64_t local_prims = 0;
+
+        void flush() {
+            rays.fetch_add(1, std::memory_order_relaxed);
+            nodes.fetch_add(local_nodes, std::memory_order_relaxed);
+            prims.fetch_add(local_prims, std::memory_order_relaxed);
+            local_nodes = 0;
+            local_prims = 0;
+        }
+
+        void reset() {
+            rays = 0;
+            nodes = 0;
+            prims = 0;
+        }
+
+        void print() const {
+            double n = std::max<uint64_t>(rays, 1);
+            std::cout << "[Tira] Traversal stats: rays: " << rays
+                << ", nodes/ray: " << nodes / n
+                << ", prims/ray: " << prims / n << "\n";
+        }
+    };
+#endif
+
+    // Object that ended the latest occlusion query of the calling thread, set by accelerators for the shadow cache.
+    inline thread_local Object const* last_occluder = nullptr;
+
+    // Farthest distance at which a hit can still replace the current one.
+    inline float closest_hit_limit(Intersection const& isect) {
+#ifdef TRIANGLE_TOLERATE_LIGHT_CLOSE_TO_SURFACE
+        // Lights slightly behind the closest hit are still accepted, see Triangle::intersect.
+        return isect.distance + EPSILON;
+#else
+        return isect.distance;
+#endif
+    }
+
+    // Whether a node entered at t can still hold a hit closer than the current one.
+    inline bool beyond_closest_hit(float t, Intersection const& isect) {
+        return t > closest_hit_limit(isect);
+    }
+
     struct Accelerator {
         std::vector<Object*> objects;
         Bound3f bound;
+#ifdef ENABLE_TRAVERSAL_STATS
+        TraversalStats stats;
+#endif
 
         Accelerator() {}
 
@@ -23,6 +91,12 @@ namespace tira {
 
         virtual void build(std::vector<Object*>&& objects) = 0;
         virtual void intersect(Ray& ray, Intersection& isect) = 0;
+        // Any-hit query, returns as soon as an object is hit before t_max.
+        virtual bool occluded(Ray& ray, float t_max) = 0;
+        // Closest hits of n coherent rays, traced one by one unless the accelerator has a packet traversal.
+        virtual void intersect_packet(Ray* rays, Intersection* isects, int n) {
+            for (int i = 0; i < n; ++i) intersect(rays[i], isects[i]);
+        }
         virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const = 0;
     };
 
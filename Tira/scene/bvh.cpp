@@ -3,87 +3,252 @@
 //
 
 #include <array>
+#include <algorithm>
 #include <scene/bvh.h>
+#include <misc/timer.h>
 
 namespace tira {
 
     void BVHAccel::build(std::vector<Object*>&& _objects) {
         objects = std::move(_objects);
+        nodes.clear();
+        references.clear();
         max_height = 0;
 
-        auto obj_num = objects.size();
-        nodes.reserve(obj_num * 2 - 1);
+        Timer timer;
 
-        BVHNode root;
-        root.left = 0;
-        root.right = 0;
-        root.first_prim = 0;
-        root.prim_count = obj_num;
-        root.height = 0;
-        root.hit_idx = -1;
-        root.miss_idx = -1;
-        nodes.push_back(root);
+        if (split_method == SplitMethod::LBVH || split_method == SplitMethod::PLOC) {
+            build_parallel();
+        }
+        else if (split_method == SplitMethod::SBVH) {
+            build_spatial();
+        }
+        else {
+            auto obj_num = objects.size();
+            nodes.reserve(obj_num * 2 - 1);
 
-        update_node_bound(0);
-        subdivide(0);
+            BVHNode root;
+            root.left = 0;
+            root.right = 0;
+            root.first_prim = 0;
+            root.prim_count = obj_num;
+            root.height = 0;
+            root.hit_idx = -1;
+            root.miss_idx = -1;
+            nodes.push_back(root);
+
+            update_node_bound(0);
+            subdivide(0);
+        }
 
+        if (optimize) optimize_treelets();
+        link_nodes();
         bound = nodes[0].bound;
+
+        if (max_height >= STACK_SIZE && traversal_method == TraversalMethod::STACK) {
+            std::cout << "[Tira] " << "BVH is too deep for stack traversal, fall back to stackless traversal\n";
+            traversal_method = TraversalMethod::STACKLESS_ORDERED;
+        }
+        // Compact layout drops the links of the other traversals.
+        if (traversal_method != TraversalMethod::STACK) compact_layout = false;
+        // Compact nodes store the leaf primitive count in 16 bits.
+        if (compact_layout && std::any_of(nodes.begin(), nodes.end(), [](BVHNode const& node) {
+                return node.prim_count > std::numeric_limits<uint16_t>::max();
+            })) {
+            std::cout << "[Tira] " << "BVH leaf has more than " << std::numeric_limits<uint16_t>::max()
+                << " primitives, skip compact layout\n";
+            compact_layout = false;
+        }
+
+        if (compact_layout) build_compact_layout();
+        else if (typed_primitives) build_typed_primitives();
+
+        build_sah_cost = sah_cost();
+
+        timer.update();
+        std::cout << "[Tira] " << "BVH (" << split_method_name(split_method) << ") build time: " << timer.delta_time()
+            << "s, nodes: " << nodes.size() << ", max height: " << max_height << ", SAH cost: " << build_sah_cost
+            << ", traversal: " << traversal_method_name(traversal_method) << (compact_layout ? ", compact layout" : "") << "\n";
+    }
+
+    bool BVHAccel::refit() {
+        Timer timer;
+
+        for (auto& o : objects) o->update_geometry();
+
+        // Children follow their parent in pre-order, visiting it backwards updates bounds bottom-up.
+        std::vector<int> order;
+        order.reserve(nodes.size());
+        std::vector<int> stack = { 0 };
+        while (!stack.empty()) {
+            int idx = stack.back();
+            stack.pop_back();
+            order.push_back(idx);
+            if (!nodes[idx].is_leaf()) {
+                stack.push_back(nodes[idx].right);
+                stack.push_back(nodes[idx].left);
+            }
+        }
+
+        auto const& prims = leaf_objects();
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            auto& node = nodes[*it];
+            Bound3f node_bound;
+            if (node.is_leaf()) {
+                for (int i = 0; i < node.prim_count; ++i) {
+                    node_bound += prims[node.first_prim + i]->get_bound();
+                }
+            }
+            else {
+                node_bound = nodes[node.left].bound;
+                node_bound += nodes[node.right].bound;
+            }
+            node.bound = node_bound;
+        }
+
+        float cost = sah_cost();
+        if (cost > build_sah_cost * BVH_REFIT_REBUILD_RATIO) {
+            std::cout << "[Tira] " << "BVH refit SAH cost " << cost << " exceeds " << BVH_REFIT_REBUILD_RATIO
+                << "x of " << build_sah_cost << ", rebuilding\n";
+            auto refit_objects = std::move(objects);
+            objects.clear();
+            build(std::move(refit_objects));
+            return true;
+        }
+
+        // Children may have moved to the other side of each other, reorder them for ordered traversal.
+        link_nodes();
+        bound = nodes[0].bound;
+        if (compact_layout) build_compact_layout();
+
+        for (auto& t : triangles) {
+            t.v0 = t.source->pos[0];
+            t.e01 = t.source->e01;
+            t.e02 = t.source->e02;
+        }
+        for (auto& s : spheres) {
+            s.center = s.source->center;
+            s.radius = s.source->radius;
+        }
+
+        timer.update();
+        std::cout << "[Tira] " << "BVH refit time: " << timer.delta_time() << "s, SAH cost: " << cost << "\n";
+        return false;
     }
 
     void BVHAccel::intersect(Ray& ray, Intersection& isect) {
         if (bound.intersect(ray) == FLOAT_MAX) {
+            TRAVERSAL_STATS_RAY();
             return;
         }
 
-#ifdef TRAVERSE_ITERATIVE
-#ifdef TRAVERSE_ITERATIVE_STACK
-        BVHNode* stack[64];
-        int ptr = 0;
-        stack[ptr++] = &nodes[0];
-        BVHNode* node;
+        if (compact_layout) {
+            intersect_compact(ray, isect);
+            TRAVERSAL_STATS_RAY();
+            return;
+        }
 
-        while (ptr > 0) {
-            node = stack[--ptr];
+        switch (traversal_method) {
+        case TraversalMethod::RECURSIVE:
+            intersect_node(ray, isect, 0); break;
+        case TraversalMethod::STACKLESS:
+            intersect_stackless(ray, isect); break;
+        case TraversalMethod::STACK:
+            intersect_stack(ray, isect); break;
+        case TraversalMethod::STACKLESS_ORDERED:
+            intersect_stackless_ordered(ray, isect); break;
+        }
 
-            if (node->is_leaf()) {
-                for (int i = 0; i < node->prim_count; ++i) {
-                    objects[node->first_prim + i]->intersect(ray, isect);
-                }
+        TRAVERSAL_STATS_RAY();
+    }
 
-                continue;
+    void BVHAccel::intersect_leaf(int idx, Ray& ray, Intersection& isect) const {
+        auto const& node = nodes[idx];
+        int i = 0;
+        if (typed_primitives) {
+            auto const& leaf = typed_leaves[idx];
+            float t, u, v;
+            for (int j = 0; j < leaf.triangle_count; ++j) {
+                TRAVERSAL_STATS_PRIM();
+                auto const& tri = triangles[leaf.first_triangle + j];
+                if (intersect_triangle(ray, tri.v0, tri.e01, tri.e02, t, u, v) && t >= ray.t_min && t <= ray.t_max) {
+                    tri.source->record_hit(t, u, v, isect);
+                }
             }
-
-            auto c0 = &nodes[node->left];
-            auto c1 = &nodes[node->right];
-
-            float dist0 = c0->bound.intersect(ray);
-            float dist1 = c1->bound.intersect(ray);
-
-            if (dist0 > dist1) {
-                std::swap(dist0, dist1);
-                std::swap(c0, c1);
+            for (int j = 0; j < leaf.sphere_count; ++j) {
+                TRAVERSAL_STATS_PRIM();
+                auto const& sph = spheres[leaf.first_sphere + j];
+                if (intersect_sphere(ray, sph.center, sph.radius, t)) {
+                    sph.source->record_hit(t, isect);
+                }
             }
+            i = leaf.triangle_count + leaf.sphere_count;
+        }
+        auto const& prims = leaf_objects();
+        for (; i < node.prim_count; ++i) {
+            TRAVERSAL_STATS_PRIM();
+            prims[node.first_prim + i]->intersect(ray, isect);
+        }
+    }
 
-            if (dist0 != FLOAT_MAX) {
-                stack[ptr++] = c0;
-                if (dist1 != FLOAT_MAX) {
-                    stack[ptr++] = c1;
+    bool BVHAccel::occluded_leaf(int idx, Ray& ray, float t_max) const {
+        auto const& node = nodes[idx];
+        int i = 0;
+        if (typed_primitives) {
+            auto const& leaf = typed_leaves[idx];
+            float t, u, v;
+            for (int j = 0; j < leaf.triangle_count; ++j) {
+                TRAVERSAL_STATS_PRIM();
+                auto const& tri = triangles[leaf.first_triangle + j];
+                if (intersect_triangle(ray, tri.v0, tri.e01, tri.e02, t, u, v) && t >= ray.t_min && t < t_max) {
+                    last_occluder = tri.source;
+                    return true;
+                }
+            }
+            for (int j = 0; j < leaf.sphere_count; ++j) {
+                TRAVERSAL_STATS_PRIM();
+                auto const& sph = spheres[leaf.first_sphere + j];
+                if (intersect_sphere(ray, sph.center, sph.radius, t) && t < t_max) {
+                    last_occluder = sph.source;
+                    return true;
                 }
             }
+            i = leaf.triangle_count + leaf.sphere_count;
         }
-#else
+        auto const& prims = leaf_objects();
+        for (; i < node.prim_count; ++i) {
+            TRAVERSAL_STATS_PRIM();
+            if (prims[node.first_prim + i]->occluded(ray, t_max)) {
+                last_occluder = prims[node.first_prim + i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Any-hit traversal follows the hit/miss links, order does not matter since any occluder terminates it.
+    bool BVHAccel::occluded(Ray& ray, float t_max) {
+        if (compact_layout) {
+            bool hit = occluded_compact(ray, t_max);
+            TRAVERSAL_STATS_RAY();
+            return hit;
+        }
+
         int idx = 0;
         while (idx >= 0) {
             auto& node = nodes[idx];
+            TRAVERSAL_STATS_NODE();
 
-            if (node.bound.intersect(ray) == FLOAT_MAX) {
+            float t = node.bound.intersect(ray);
+            if (t == FLOAT_MAX || t > t_max) {
                 idx = node.miss_idx;
                 continue;
             }
 
             if (node.is_leaf()) {
-                for (int i = 0; i < node.prim_count; ++i) {
-                    objects[node.first_prim + i]->intersect(ray, isect);
+                if (occluded_leaf(idx, ray, t_max)) {
+                    TRAVERSAL_STATS_RAY();
+                    return true;
                 }
                 idx = node.miss_idx;
             }
@@ -91,23 +256,21 @@ namespace tira {
                 idx = node.hit_idx;
             }
         }
-#endif
-#else
-        intersect_node(ray, isect, 0);
-#endif
+
+        TRAVERSAL_STATS_RAY();
+        return false;
     }
 
     void BVHAccel::intersect_node(Ray& ray, Intersection& isect, int idx) const {
         auto& node = nodes[idx];
+        TRAVERSAL_STATS_NODE();
 
         if (node.bound.intersect(ray) == FLOAT_MAX) {
             return;
         }
 
         if (node.is_leaf()) {
-            for (int i = 0; i < node.prim_count; ++i) {
-                objects[node.first_prim + i]->intersect(ray, isect);
-            }
+            intersect_leaf(idx, ray, isect);
         }
         else {
             intersect_node(ray, isect, node.left);
@@ -115,6 +278,368 @@ namespace tira {
         }
     }
 
+    // Follows the precomputed hit/miss links, same as the GPU kernel.
+    void BVHAccel::intersect_stackless(Ray& ray, Intersection& isect) const {
+        int idx = 0;
+        while (idx >= 0) {
+            auto& node = nodes[idx];
+            TRAVERSAL_STATS_NODE();
+
+            if (node.bound.intersect(ray) == FLOAT_MAX) {
+                idx = node.miss_idx;
+                continue;
+            }
+
+            if (node.is_leaf()) {
+                intersect_leaf(idx, ray, isect);
+                idx = node.miss_idx;
+            }
+            else {
+                idx = node.hit_idx;
+            }
+        }
+    }
+
+    // Visits the nearer child first and pops the farther one only if it starts before the closest hit.
+    void BVHAccel::intersect_stack(Ray& ray, Intersection& isect) const {
+        struct Entry {
+            int idx;
+            float t;
+        } stack[STACK_SIZE];
+        int ptr = 0;
+        int idx = 0;
+
+        while (true) {
+            auto& node = nodes[idx];
+
+            if (node.is_leaf()) {
+                intersect_leaf(idx, ray, isect);
+            }
+            else {
+                int c0 = node.left;
+                int c1 = node.right;
+                float t0 = nodes[c0].bound.intersect(ray);
+                float t1 = nodes[c1].bound.intersect(ray);
+                TRAVERSAL_STATS_NODE();
+                TRAVERSAL_STATS_NODE();
+
+                if (t0 > t1) {
+                    std::swap(t0, t1);
+                    std::swap(c0, c1);
+                }
+
+                if (t0 != FLOAT_MAX && !beyond_closest_hit(t0, isect)) {
+                    if (t1 != FLOAT_MAX && !beyond_closest_hit(t1, isect)) {
+                        stack[ptr++] = { c1, t1 };
+                    }
+                    idx = c0;
+                    continue;
+                }
+            }
+
+            // Pop the next node that may still hold a closer hit.
+            idx = -1;
+            while (ptr > 0) {
+                auto const& e = stack[--ptr];
+                if (!beyond_closest_hit(e.t, isect)) {
+                    idx = e.idx;
+                    break;
+                }
+            }
+            if (idx < 0) break;
+        }
+    }
+
+    /**
+     * Stackless traversal with parent links as in: Michal Hapala et al., Efficient Stack-less BVH Traversal for Ray Tracing.
+     * Children are visited in the order given by the ray direction sign on the split axis of the node,
+     * nodes entered beyond the closest hit are treated as missed.
+     */
+    void BVHAccel::intersect_stackless_ordered(Ray& ray, Intersection& isect) const {
+        enum struct State { FromParent, FromSibling, FromChild };
+
+        auto near_child = [&](BVHNode const& node) {
+            return ray.sign[node.axis] ? node.right : node.left;
+        };
+        auto far_child = [&](BVHNode const& node) {
+            return ray.sign[node.axis] ? node.left : node.right;
+        };
+        // Returns true if the node is hit and not a leaf, leaves are intersected right away.
+        auto visit = [&](BVHNode const& node, bool& hit) {
+            TRAVERSAL_STATS_NODE();
+            float t = node.bound.intersect(ray);
+            hit = t != FLOAT_MAX && !beyond_closest_hit(t, isect);
+            if (!hit) return false;
+            if (node.is_leaf()) {
+                intersect_leaf(int(&node - nodes.data()), ray, isect);
+                return false;
+            }
+            return true;
+        };
+
+        if (nodes[0].is_leaf()) {
+            bool hit;
+            visit(nodes[0], hit);
+            return;
+        }
+
+        int idx = near_child(nodes[0]);
+        State state = State::FromParent;
+        bool hit;
+
+        while (true) {
+            auto const& node = nodes[idx];
+            switch (state) {
+            case State::FromChild:
+                if (idx == 0) return;
+                if (idx == near_child(nodes[node.parent])) {
+                    idx = far_child(nodes[node.parent]);
+                    state = State::FromSibling;
+                }
+                else {
+                    idx = node.parent;
+                    state = State::FromChild;
+                }
+                break;
+            case State::FromSibling:
+                if (visit(node, hit)) {
+                    idx = near_child(node);
+                    state = State::FromParent;
+                }
+                else {
+                    idx = node.parent;
+                    state = State::FromChild;
+                }
+                break;
+            case State::FromParent:
+                if (visit(node, hit)) {
+                    idx = near_child(node);
+                    state = State::FromParent;
+                }
+                else {
+                    idx = far_child(nodes[node.parent]);
+                    state = State::FromSibling;
+                }
+                break;
+            }
+        }
+    }
+
+    // Slab test in [t_min, t_far], same as Bound3f::intersect(ray, t0, t1).
+    static bool intersect_compact_bound(CompactBVHNode const& node, Ray const& ray, float t_far) {
+        float t0 = ray.t_min;
+        float t1 = t_far;
+        for (int a = 0; a < 3; ++a) {
+            float lo = ray.sign[a] ? node.bound_max[a] : node.bound_min[a];
+            float hi = ray.sign[a] ? node.bound_min[a] : node.bound_max[a];
+            t0 = std::max(t0, (lo - ray.origin[a]) * ray.inv_dir[a]);
+            t1 = std::min(t1, (hi - ray.origin[a]) * ray.inv_dir[a]);
+        }
+        return t0 <= t1;
+    }
+
+    void BVHAccel::intersect_compact_leaf(CompactBVHNode const& node, Ray& ray, Intersection& isect) const {
+        float t, u, v;
+        for (int i = 0; i < node.prim_count; ++i) {
+            TRAVERSAL_STATS_PRIM();
+            auto const& prim = leaf_primitives[node.offset + i];
+            if (!prim.is_triangle) {
+                prim.source->intersect(ray, isect);
+            }
+            else if (intersect_triangle(ray, prim.v0, prim.e01, prim.e02, t, u, v) && t >= ray.t_min && t <= ray.t_max) {
+                static_cast<Triangle const*>(prim.source)->record_hit(t, u, v, isect);
+            }
+        }
+    }
+
+    /**
+     * Front-to-back traversal of the compact layout: the child on the side of the split axis the ray comes from
+     * is visited first and the other one is pushed. Only the visited node is tested, against the closest hit so far.
+     */
+    void BVHAccel::intersect_compact(Ray& ray, Intersection& isect, int root) const {
+        int stack[STACK_SIZE];
+        int ptr = 0;
+        int idx = root;
+
+        while (true) {
+            auto const& node = compact_nodes[idx];
+            TRAVERSAL_STATS_NODE();
+
+            if (intersect_compact_bound(node, ray, closest_hit_limit(isect))) {
+                if (node.prim_count > 0) {
+                    intersect_compact_leaf(node, ray, isect);
+                }
+                else if (ray.sign[node.axis]) {
+                    stack[ptr++] = idx + 1;
+                    idx = node.offset;
+                    continue;
+                }
+                else {
+                    stack[ptr++] = node.offset;
+                    idx = idx + 1;
+                    continue;
+                }
+            }
+
+            if (ptr == 0) break;
+            idx = stack[--ptr];
+        }
+    }
+
+    bool BVHAccel::occluded_compact(Ray& ray, float t_max) const {
+        int stack[STACK_SIZE];
+        int ptr = 0;
+        int idx = 0;
+        float t, u, v;
+
+        while (true) {
+            auto const& node = compact_nodes[idx];
+            TRAVERSAL_STATS_NODE();
+
+            if (intersect_compact_bound(node, ray, t_max)) {
+                if (node.prim_count == 0) {
+                    stack[ptr++] = node.offset;
+                    idx = idx + 1;
+                    continue;
+                }
+                for (int i = 0; i < node.prim_count; ++i) {
+                    TRAVERSAL_STATS_PRIM();
+                    auto const& prim = leaf_primitives[node.offset + i];
+                    bool hit = prim.is_triangle
+                        ? intersect_triangle(ray, prim.v0, prim.e01, prim.e02, t, u, v) && t >= ray.t_min && t < t_max
+                        : prim.source->occluded(ray, t_max);
+                    if (hit) {
+                        last_occluder = prim.source;
+                        return true;
+                    }
+                }
+            }
+
+            if (ptr == 0) break;
+            idx = stack[--ptr];
+        }
+
+        return false;
+    }
+
+    /**
+     * Bounds of the origins and inverse directions of a packet whose rays share direction signs.
+     * Slab distances are bounded by interval arithmetic, a node is culled when the bounds cannot overlap,
+     * as then no ray of the packet hits it.
+     */
+    struct PacketFrustum {
+        float3 origin_min, origin_max;
+        float3 inv_dir_min, inv_dir_max;
+        int3 sign;
+
+        // Returns false if the rays differ in sign or are parallel to an axis.
+        bool init(Ray const* rays, int n) {
+            sign = rays[0].sign;
+            origin_min = origin_max = rays[0].origin;
+            inv_dir_min = inv_dir_max = rays[0].inv_dir;
+            for (int i = 1; i < n; ++i) {
+                for (int a = 0; a < 3; ++a) {
+                    if (rays[i].sign[a] != sign[a]) return false;
+                    origin_min[a] = std::min(origin_min[a], rays[i].origin[a]);
+                    origin_max[a] = std::max(origin_max[a], rays[i].origin[a]);
+                    inv_dir_min[a] = std::min(inv_dir_min[a], rays[i].inv_dir[a]);
+                    inv_dir_max[a] = std::max(inv_dir_max[a], rays[i].inv_dir[a]);
+                }
+            }
+            for (int a = 0; a < 3; ++a) {
+                if (!std::isfinite(inv_dir_min[a]) || !std::isfinite(inv_dir_max[a])) return false;
+            }
+            return true;
+        }
+
+        // Interval of (p - origin) * inv_dir along axis a over the packet.
+        void slab(float p, int a, float& t_lo, float& t_hi) const {
+            float d0 = p - origin_max[a];
+            float d1 = p - origin_min[a];
+            float t00 = d0 * inv_dir_min[a], t01 = d0 * inv_dir_max[a];
+            float t10 = d1 * inv_dir_min[a], t11 = d1 * inv_dir_max[a];
+            t_lo = std::min(std::min(t00, t01), std::min(t10, t11));
+            t_hi = std::max(std::max(t00, t01), std::max(t10, t11));
+        }
+
+        bool intersect(CompactBVHNode const& node, float t_min, float t_max) const {
+            float t0 = t_min;
+            float t1 = t_max;
+            float lo, hi;
+            for (int a = 0; a < 3; ++a) {
+                slab(sign[a] ? node.bound_max[a] : node.bound_min[a], a, lo, hi);
+                t0 = std::max(t0, lo);
+                slab(sign[a] ? node.bound_min[a] : node.bound_max[a], a, lo, hi);
+                t1 = std::min(t1, hi);
+            }
+            return t0 <= t1;
+        }
+    };
+
+    void BVHAccel::intersect_packet(Ray* rays, Intersection* isects, int n) {
+        PacketFrustum frustum;
+        if (!compact_layout || n < PACKET_MIN_ACTIVE || !frustum.init(rays, n)) {
+            Accelerator::intersect_packet(rays, isects, n);
+            return;
+        }
+
+        // Farthest closest hit over the packet, nodes beyond it are culled.
+        auto packet_hit_limit = [&]() {
+            float t = 0.f;
+            for (int i = 0; i < n; ++i) t = std::max(t, closest_hit_limit(isects[i]));
+            return t;
+        };
+
+        // Rays before first miss every ancestor of the node, so they are skipped in its subtree.
+        struct StackEntry {
+            int idx;
+            int first;
+        };
+        StackEntry stack[STACK_SIZE];
+        int ptr = 0;
+        StackEntry e = { 0, 0 };
+        float t_max = FLOAT_MAX;
+
+        while (true) {
+            auto const& node = compact_nodes[e.idx];
+            TRAVERSAL_STATS_NODE();
+
+            if (frustum.intersect(node, rays[0].t_min, t_max)) {
+                int first = e.first;
+                while (first < n && !intersect_compact_bound(node, rays[first], closest_hit_limit(isects[first]))) ++first;
+
+                if (n - first < PACKET_MIN_ACTIVE) {
+                    // Rays have diverged, the remaining ones are cheaper to trace on their own.
+                    for (int i = first; i < n; ++i) intersect_compact(rays[i], isects[i], e.idx);
+                    t_max = packet_hit_limit();
+                }
+                else if (node.prim_count > 0) {
+                    for (int i = first; i < n; ++i) {
+                        if (intersect_compact_bound(node, rays[i], closest_hit_limit(isects[i]))) {
+                            intersect_compact_leaf(node, rays[i], isects[i]);
+                        }
+                    }
+                    t_max = packet_hit_limit();
+                }
+                else if (frustum.sign[node.axis]) {
+                    stack[ptr++] = { e.idx + 1, first };
+                    e = { node.offset, first };
+                    continue;
+                }
+                else {
+                    stack[ptr++] = { node.offset, first };
+                    e = { e.idx + 1, first };
+                    continue;
+                }
+            }
+
+            if (ptr == 0) break;
+            e = stack[--ptr];
+        }
+
+        for (int i = 0; i < n; ++i) TRAVERSAL_STATS_RAY();
+    }
+
     void BVHAccel::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
         draw_wireframeNode(image, transform, color, 0);
     }
@@ -177,45 +702,16 @@ namespace tira {
                 int left_count = i - node.first_prim;
                 if (left_count == 0 || left_count == node.prim_count) continue;
 
-                BVHNode left;
-                left.first_prim = node.first_prim;
-                left.prim_count = left_count;
-                left.left = left.right = 0;
-                left.height = node.height + 1;
-                left.hit_idx = -1;
-                left.miss_idx = -1;
-
-                BVHNode right;
-                right.first_prim = i;
-                right.prim_count = node.prim_count - left_count;
-                right.left = right.right = 0;
-                right.height = node.height + 1;
-                right.hit_idx = -1;
-                right.miss_idx = -1;
-
-                node.left = nodes.size();
-                nodes.push_back(left);
-                node.right = nodes.size();
-                nodes.push_back(right);
-
-                node.prim_count = 0;
-                node.hit_idx = node.left;
-                nodes[node.left].miss_idx = node.right;
-                if (node.miss_idx >= 0) nodes[node.right].miss_idx = node.miss_idx;
-
-                update_node_bound(node.left);
-                update_node_bound(node.right);
-
-                subdivide(node.left);
-                subdivide(node.right);
-
+                create_children(idx, left_count);
                 break;
             }
         }
+        else if (split_method == SplitMethod::BINNED) {
+            subdivide_binned(idx);
+        }
         else {
             // Surface Area Heuristic
             int best_axis = 0;
-            int axis = axes[0];
             float best_sah = std::numeric_limits<float>::max();
             int best_left_count;
             int step = 1;
@@ -258,38 +754,295 @@ namespace tira {
                 return x->get_center()[best_axis] < y->get_center()[best_axis];
             });
 
-            BVHNode left;
-            left.first_prim = node.first_prim;
-            left.prim_count = best_left_count;
-            left.left = left.right = 0;
-            left.height = node.height + 1;
-            left.hit_idx = -1;
-            left.miss_idx = -1;
-
-            BVHNode right;
-            right.first_prim = node.first_prim + best_left_count;
-            right.prim_count = node.prim_count - best_left_count;
-            right.left = right.right = 0;
-            right.height = node.height + 1;
-            right.hit_idx = -1;
-            right.miss_idx = -1;
-
-            node.left = nodes.size();
-            nodes.push_back(left);
-            node.right = nodes.size();
-            nodes.push_back(right);
-
-            node.prim_count = 0;
+            create_children(idx, best_left_count);
+        }
+    }
+
+    /**
+     * Binned SAH as in: Ingo Wald, On fast Construction of SAH-based Bounding Volume Hierarchies.
+     * Object centers are projected into SAH_BINS bins along each axis, then all the candidate
+     * planes between bins are evaluated with one prefix and one suffix sweep, which makes each
+     * subdivide O(N) rather than a sort plus a bound accumulation per candidate.
+     */
+    void BVHAccel::subdivide_binned(int idx) {
+        BVHNode& node = nodes[idx];
+
+        struct Bin {
+            Bound3f bound;
+            int count = 0;
+        };
+
+        Bound3f center_bound;
+        for (int i = 0; i < node.prim_count; ++i) {
+            center_bound += objects[node.first_prim + i]->get_center();
+        }
+        float3 center_extent = center_bound.get_extent();
+
+        auto get_bin = [&](Object const* object, int axis) {
+            float k = SAH_BINS / center_extent[axis];
+            int b = (object->get_center()[axis] - center_bound.min[axis]) * k;
+            return clamp(b, 0, SAH_BINS - 1);
+        };
+
+        int best_axis = -1;
+        int best_bin = 0;
+        float best_sah = std::numeric_limits<float>::max();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (center_extent[axis] <= 0) continue;
+
+            Bin bins[SAH_BINS];
+            for (int i = 0; i < node.prim_count; ++i) {
+                auto object = objects[node.first_prim + i];
+                auto& bin = bins[get_bin(object, axis)];
+                bin.bound += object->get_bound();
+                ++bin.count;
+            }
+
+            // Prefix sweep, left_area[i] and left_count[i] describe bins [0, i].
+            float left_area[SAH_BINS - 1];
+            int left_count[SAH_BINS - 1];
+            Bound3f left_bound;
+            int count = 0;
+            for (int i = 0; i < SAH_BINS - 1; ++i) {
+                left_bound += bins[i].bound;
+                count += bins[i].count;
+                left_count[i] = count;
+                left_area[i] = count > 0 ? left_bound.get_surface_area() : 0.f;
+            }
+
+            // Suffix sweep, the plane in front of bin i puts bins [i, SAH_BINS) to the right.
+            Bound3f right_bound;
+            count = 0;
+            for (int i = SAH_BINS - 1; i > 0; --i) {
+                right_bound += bins[i].bound;
+                count += bins[i].count;
+                if (count == 0 || left_count[i - 1] == 0) continue;
+
+                float sah = left_area[i - 1] * left_count[i - 1] + right_bound.get_surface_area() * count;
+                if (sah < best_sah) {
+                    best_sah = sah;
+                    best_axis = axis;
+                    best_bin = i;
+                }
+            }
+        }
+
+        int left_count = node.prim_count / 2;
+        if (best_axis >= 0) {
+            auto first = objects.begin() + node.first_prim;
+            auto middle = std::partition(first, first + node.prim_count, [&](Object const* object) {
+                return get_bin(object, best_axis) < best_bin;
+            });
+            left_count = middle - first;
+        }
+        // Otherwise all centers coincide and any partition is as good as another.
+
+        create_children(idx, left_count);
+    }
+
+    void BVHAccel::create_children(int idx, int left_count) {
+        BVHNode& node = nodes[idx];
+
+        BVHNode left;
+        left.first_prim = node.first_prim;
+        left.prim_count = left_count;
+        left.left = left.right = 0;
+        left.height = node.height + 1;
+
+        BVHNode right;
+        right.first_prim = node.first_prim + left_count;
+        right.prim_count = node.prim_count - left_count;
+        right.left = right.right = 0;
+        right.height = node.height + 1;
+
+        node.left = nodes.size();
+        nodes.push_back(left);
+        node.right = nodes.size();
+        nodes.push_back(right);
+        node.prim_count = 0;
+
+        update_node_bound(node.left);
+        update_node_bound(node.right);
+
+        subdivide(node.left);
+        subdivide(node.right);
+    }
+
+    /**
+     * Orders the children of each internal node along the axis their centers differ most,
+     * then sets up parent links, heights and the hit/miss links of stackless traversal:
+     * hit goes to the left child, miss goes to the right sibling or to the miss link of parent.
+     */
+    void BVHAccel::link_nodes() {
+        max_height = 0;
+        nodes[0].parent = -1;
+        nodes[0].height = 0;
+        nodes[0].miss_idx = -1;
+
+        std::vector<int> stack = { 0 };
+        while (!stack.empty()) {
+            int idx = stack.back();
+            stack.pop_back();
+
+            auto& node = nodes[idx];
+            node.hit_idx = -1;
+            node.axis = 0;
+            if (node.height > max_height) max_height = node.height;
+            if (node.is_leaf()) continue;
+
+            auto d = nodes[node.right].bound.get_center() - nodes[node.left].bound.get_center();
+            float3 abs_d = { std::abs(d.x), std::abs(d.y), std::abs(d.z) };
+            node.axis = abs_d.x > abs_d.y ? (abs_d.x > abs_d.z ? 0 : 2) : (abs_d.y > abs_d.z ? 1 : 2);
+            if (d[node.axis] < 0) std::swap(node.left, node.right);
+
+            auto& left = nodes[node.left];
+            auto& right = nodes[node.right];
             node.hit_idx = node.left;
-            nodes[node.left].miss_idx = node.right;
-            if (node.miss_idx >= 0) nodes[node.right].miss_idx = node.miss_idx;
+            left.miss_idx = node.right;
+            right.miss_idx = node.miss_idx;
+            left.parent = right.parent = idx;
+            left.height = right.height = node.height + 1;
+
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+        }
+    }
+
+    /**
+     * Partitions every leaf into triangles, spheres and other objects,
+     * then stores hit test data of triangles and spheres into the typed arrays in leaf order.
+     */
+    void BVHAccel::build_typed_primitives() {
+        triangles.clear();
+        spheres.clear();
+        typed_leaves.assign(nodes.size(), TypedLeaf{ 0, 0, 0, 0 });
 
-            update_node_bound(node.left);
-            update_node_bound(node.right);
+        auto rank = [](Object const* o) {
+            if (dynamic_cast<Triangle const*>(o)) return 0;
+            if (dynamic_cast<Sphere const*>(o)) return 1;
+            return 2;
+        };
+
+        auto& prims = references.empty() ? objects : references;
+        for (int idx = 0; idx < (int)nodes.size(); ++idx) {
+            auto const& node = nodes[idx];
+            if (!node.is_leaf()) continue;
+
+            auto begin = prims.begin() + node.first_prim;
+            auto end = begin + node.prim_count;
+            std::stable_sort(begin, end, [&](Object const* a, Object const* b) { return rank(a) < rank(b); });
+
+            auto& leaf = typed_leaves[idx];
+            leaf.first_triangle = triangles.size();
+            leaf.first_sphere = spheres.size();
+            for (auto it = begin; it != end; ++it) {
+                if (auto t = dynamic_cast<Triangle const*>(*it)) {
+                    triangles.push_back({ t->pos[0], t->e01, t->e02, t });
+                    ++leaf.triangle_count;
+                }
+                else if (auto s = dynamic_cast<Sphere const*>(*it)) {
+                    spheres.push_back({ s->center, s->radius, s });
+                    ++leaf.sphere_count;
+                }
+            }
+        }
+    }
+
+    /**
+     * Copies nodes into compact_nodes in depth-first order, first child right after its parent,
+     * and the primitives of every leaf into leaf_primitives as the leaves are reached.
+     */
+    void BVHAccel::build_compact_layout() {
+        compact_nodes.clear();
+        compact_nodes.reserve(nodes.size());
+        leaf_primitives.clear();
+        auto const& prims = leaf_objects();
+        leaf_primitives.reserve(prims.size());
+
+        struct Task {
+            int idx;
+            // Compact node whose second child is this one, -1 if none.
+            int parent;
+        };
+        std::vector<Task> stack = { { 0, -1 } };
+        while (!stack.empty()) {
+            auto task = stack.back();
+            stack.pop_back();
+
+            int compact_idx = compact_nodes.size();
+            if (task.parent >= 0) compact_nodes[task.parent].offset = compact_idx;
+
+            auto const& node = nodes[task.idx];
+            CompactBVHNode compact;
+            for (int a = 0; a < 3; ++a) {
+                compact.bound_min[a] = node.bound.min[a];
+                compact.bound_max[a] = node.bound.max[a];
+            }
+            compact.axis = node.axis;
+            compact.pad = 0;
+
+            if (node.is_leaf()) {
+                compact.offset = leaf_primitives.size();
+                compact.prim_count = node.prim_count;
+                for (int i = 0; i < node.prim_count; ++i) {
+                    auto o = prims[node.first_prim + i];
+                    if (auto tri = dynamic_cast<Triangle const*>(o)) {
+                        leaf_primitives.push_back({ tri->pos[0], tri->e01, tri->e02, 1, tri });
+                    }
+                    else {
+                        leaf_primitives.push_back({ float3(), float3(), float3(), 0, o });
+                    }
+                }
+            }
+            else {
+                compact.offset = -1;
+                compact.prim_count = 0;
+                stack.push_back({ node.right, compact_idx });
+                stack.push_back({ node.left, -1 });
+            }
+            compact_nodes.push_back(compact);
+        }
+    }
+
+    float BVHAccel::sah_cost() const {
+        constexpr float traversal_cost = 1.f;
+        constexpr float intersect_cost = 1.f;
+
+        float root_area = nodes[0].bound.get_surface_area();
+        if (root_area <= 0) return 0.f;
+
+        float cost = 0.f;
+        for (auto const& node : nodes) {
+            float p = node.bound.get_surface_area() / root_area;
+            if (node.is_leaf())
+                cost += p * node.prim_count * intersect_cost;
+            else
+                cost += p * traversal_cost;
+        }
+        return cost;
+    }
+
+    char const* BVHAccel::split_method_name(SplitMethod method) {
+        switch (method) {
+        case SplitMethod::NAIVE:  return "naive";
+        case SplitMethod::SAH:    return "sah";
+        case SplitMethod::BINNED: return "binned";
+        case SplitMethod::LBVH:   return "lbvh";
+        case SplitMethod::PLOC:   return "ploc";
+        case SplitMethod::SBVH:   return "sbvh";
+        }
+        return "unknown";
+    }
 
-            subdivide(node.left);
-            subdivide(node.right);
+    char const* BVHAccel::traversal_method_name(TraversalMethod method) {
+        switch (method) {
+        case TraversalMethod::RECURSIVE:         return "recursive";
+        case TraversalMethod::STACKLESS:         return "stackless";
+        case TraversalMethod::STACK:             return "stack";
+        case TraversalMethod::STACKLESS_ORDERED: return "stackless-ordered";
         }
+        return "unknown";
     }
 
     void BVHAccel::update_node_bound(int idx) {
@@ -6,10 +6,13 @@
 #define BVH_H
 
 #include <vector>
+#include <cstdint>
 #include <scene/accel.h>
 #include <misc/utils.h>
 #include <misc/image.h>
 #include <geometry/object.h>
+#include <geometry/triangle.h>
+#include <geometry/sphere.h>
 
 namespace tira {
 
@@ -21,33 +24,169 @@ namespace tira {
         int height;
         int miss_idx;
         int hit_idx;
+        // For ordered traversal, left child is the one on the lower side of axis.
+        int parent;
+        int axis;
 
         bool is_leaf() const { return prim_count > 0; }
     };
 
+    /**
+     * Node of the compact layout, 32 bytes in depth-first order.
+     * The first child of an inner node follows it, so only the second one is stored.
+     */
+    struct CompactBVHNode {
+        float bound_min[3];
+        float bound_max[3];
+        // Second child of inner node, first leaf primitive of leaf.
+        int offset;
+        // Primitive count of leaf, 0 for inner node.
+        uint16_t prim_count;
+        // Split axis of inner node, the first child is on its lower side.
+        uint8_t axis;
+        uint8_t pad;
+    };
+
+    // Primitive of the compact layout, objects other than triangles are intersected through source.
+    struct LeafPrimitive {
+        float3 v0, e01, e02;
+        int is_triangle;
+        Object const* source;
+    };
+
+    // Geometry needed by the hit test, the source object fills in the intersection on hit.
+    struct TypedTriangle {
+        float3 v0, e01, e02;
+        Triangle const* source;
+    };
+
+    struct TypedSphere {
+        float3 center;
+        float radius;
+        Sphere const* source;
+    };
+
+    // Ranges of a leaf in the typed primitive arrays, objects of other types follow them in the leaf.
+    struct TypedLeaf {
+        int first_triangle, triangle_count;
+        int first_sphere, sphere_count;
+    };
+
     struct BVHAccel : Accelerator {
-        enum struct SplitMethod { NAIVE, SAH };
+        enum struct SplitMethod { NAIVE, SAH, BINNED, LBVH, PLOC, SBVH };
+        enum struct TraversalMethod { RECURSIVE, STACKLESS, STACK, STACKLESS_ORDERED };
         std::vector<BVHNode> nodes;
         SplitMethod split_method;
+        TraversalMethod traversal_method = DEFAULT_TRAVERSAL_METHOD;
         int max_objs;
         int max_height;
+        // Restructure treelets after build to lower SAH cost, for final renders that can spend more build time.
+        bool optimize = false;
+        // SAH cost right after build, refit compares against it to decide on a rebuild.
+        float build_sah_cost = 0.f;
+        // Leaf references of spatial split BVH, where an object may appear in several leaves.
+        // Empty for the other split methods, leaves then index objects directly.
+        std::vector<Object*> references;
+
+        /**
+         * Typed primitive storage: hit test data of triangles and spheres is stored contiguously in leaf order,
+         * leaves test it without virtual calls and let the source object record the hit.
+         */
+#ifdef BVH_TYPED_PRIMITIVES
+        bool typed_primitives = true;
+#else
+        bool typed_primitives = false;
+#endif
+        std::vector<TypedTriangle> triangles;
+        std::vector<TypedSphere> spheres;
+        std::vector<TypedLeaf> typed_leaves;
+
+        /**
+         * Compact layout: a depth-first copy of nodes without the links only needed by other traversals,
+         * and the primitives of leaves copied contiguously in the same order, so that traversal walks
+         * memory mostly forward. Replaces nodes and the typed arrays in stack traversal.
+         */
+#ifdef BVH_COMPACT_LAYOUT
+        bool compact_layout = true;
+#else
+        bool compact_layout = false;
+#endif
+        std::vector<CompactBVHNode> compact_nodes;
+        std::vector<LeafPrimitive> leaf_primitives;
 
 #ifdef BVH_WITH_SAH
-        BVHAccel(int _max_objs = 2, SplitMethod _split_method = SplitMethod::SAH)
+        static constexpr SplitMethod DEFAULT_SPLIT_METHOD = SplitMethod::SAH;
+#else
+        static constexpr SplitMethod DEFAULT_SPLIT_METHOD = SplitMethod::NAIVE;
+#endif
+
+#if !defined(TRAVERSE_ITERATIVE)
+        static constexpr TraversalMethod DEFAULT_TRAVERSAL_METHOD = TraversalMethod::RECURSIVE;
+#elif defined(TRAVERSE_ITERATIVE_STACK)
+        static constexpr TraversalMethod DEFAULT_TRAVERSAL_METHOD = TraversalMethod::STACK;
+#elif defined(TRAVERSE_ORDERED)
+        static constexpr TraversalMethod DEFAULT_TRAVERSAL_METHOD = TraversalMethod::STACKLESS_ORDERED;
 #else
-        BVHAccel(int _max_objs = 2, SplitMethod _split_method = SplitMethod::NAIVE)
+        static constexpr TraversalMethod DEFAULT_TRAVERSAL_METHOD = TraversalMethod::STACKLESS;
 #endif
+
+        static constexpr int STACK_SIZE = 128;
+        // Active rays of a packet below which traversal continues ray by ray.
+        static constexpr int PACKET_MIN_ACTIVE = 4;
+        // Leaves of a treelet restructured by optimize.
+        static constexpr int TREELET_SIZE = 7;
+
+        BVHAccel(int _max_objs = 2, SplitMethod _split_method = DEFAULT_SPLIT_METHOD)
             : max_objs(_max_objs)
             , split_method(_split_method) {}
         ~BVHAccel() {}
 
         virtual void build(std::vector<Object*>&& objects) override;
         virtual void intersect(Ray& ray, Intersection& isect) override;
+        virtual bool occluded(Ray& ray, float t_max) override;
+        /**
+         * Packet traversal of the compact layout, nodes are culled for the whole packet by interval arithmetic.
+         * Rays are traced one by one if their directions differ in sign, and through a subtree once few of them remain active in it.
+         */
+        virtual void intersect_packet(Ray* rays, Intersection* isects, int n) override;
         virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override;
 
+        /**
+         * Updates cached geometry of objects and node bounds bottom-up after objects moved, keeping the topology.
+         * Rebuilds instead when SAH cost exceeds BVH_REFIT_REBUILD_RATIO times the cost after build.
+         * References of spatial split BVH are refitted to whole objects, so it degrades faster than other split methods.
+         * Returns whether the tree was rebuilt.
+         */
+        bool refit();
+
+        std::vector<Object*> const& leaf_objects() const { return references.empty() ? objects : references; }
+
+        // SAH cost of the whole tree, normalized by the surface area of root.
+        float sah_cost() const;
+
+        static char const* split_method_name(SplitMethod method);
+        static char const* traversal_method_name(TraversalMethod method);
+
     private:
+        void intersect_leaf(int idx, Ray& ray, Intersection& isect) const;
+        bool occluded_leaf(int idx, Ray& ray, float t_max) const;
+        void build_typed_primitives();
+        void build_compact_layout();
+        void intersect_compact_leaf(CompactBVHNode const& node, Ray& ray, Intersection& isect) const;
+        void intersect_compact(Ray& ray, Intersection& isect, int root = 0) const;
+        bool occluded_compact(Ray& ray, float t_max) const;
         void intersect_node(Ray& ray, Intersection& isect, int idx) const;
+        void intersect_stackless(Ray& ray, Intersection& isect) const;
+        void intersect_stack(Ray& ray, Intersection& isect) const;
+        void intersect_stackless_ordered(Ray& ray, Intersection& isect) const;
+        void link_nodes();
         void subdivide(int idx);
+        void subdivide_binned(int idx);
+        void build_parallel();
+        void build_spatial();
+        void optimize_treelets();
+        void restructure(int idx, int depth, std::vector<float>& costs);
+        void create_children(int idx, int left_count);
         void update_node_bound(int idx);
         void draw_wireframeNode(Image& image, float4x4 const& transform, colorf const& color, int idx) const;
     };
@@ -0,0 +1,253 @@
+//
+// Created by Ziyi.Lu 2023/04/24
+//
+
+#include <cmath>
+#include <cstring>
+#include <scene/cbvh.h>
+#include <misc/timer.h>
+
+namespace tira {
+
+    // 2^e for e in [-126, 127], built from the exponent bits.
+    static inline float exp2i(int e) {
+        uint32_t bits = uint32_t(e + 127) << 23;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    // q * 2^e is exact, so build and traversal agree on the dequantized coordinate.
+    static inline float dequantize(float origin, float scale, int q) {
+        return origin + q * scale;
+    }
+
+    template <typename T>
+    void CompressedBVHAccel<T>::build(std::vector<Object*>&& _objects) {
+        BVHAccel bvh(max_objs, split_method);
+        bvh.typed_primitives = false;
+        bvh.compact_layout = false;
+        bvh.build(std::move(_objects));
+
+        Timer timer;
+        compress(bvh.nodes);
+        objects = std::move(bvh.objects);
+        references = std::move(bvh.references);
+        bound = bvh.bound;
+        // Each level pops one entry and pushes at most 2.
+        stack_size = max_height + 2;
+        timer.update();
+
+        float n = std::max<size_t>(objects.size(), 1);
+        std::cout << "[Tira] " << "Compressed BVH (" << sizeof(T) * 8 << " bit) conversion time: " << timer.delta_time()
+            << "s, nodes: " << nodes.size() << ", node bytes per object: "
+            << bvh.nodes.size() * sizeof(BVHNode) / n << " standard, "
+            << nodes.size() * sizeof(CompressedBVHNode<T>) / n << " compressed\n";
+    }
+
+    template <typename T>
+    void CompressedBVHAccel<T>::compress(std::vector<BVHNode> const& bvh_nodes) {
+        nodes.clear();
+        nodes.emplace_back();
+        max_height = 0;
+
+        struct Task {
+            int bvh_idx;
+            int idx;
+            int height;
+        };
+        std::vector<Task> tasks = { { 0, 0, 1 } };
+
+        while (!tasks.empty()) {
+            auto task = tasks.back();
+            tasks.pop_back();
+            if (task.height > max_height) max_height = task.height;
+
+            // A leaf root takes the first slot of a node of its own.
+            auto const& bvh_node = bvh_nodes[task.bvh_idx];
+            int children[2] = { task.bvh_idx, -1 };
+            if (!bvh_node.is_leaf()) {
+                children[0] = bvh_node.left;
+                children[1] = bvh_node.right;
+            }
+
+            CompressedBVHNode<T> node;
+            Bound3f const& frame = bvh_node.bound;
+            float scale[3];
+            for (int a = 0; a < 3; ++a) {
+                node.origin[a] = frame.min[a];
+
+                // Smallest power of two step that spans the frame in QMAX steps.
+                int e = -126;
+                float extent = frame.max[a] - frame.min[a];
+                if (extent > 0) {
+                    std::frexp(extent / QMAX, &e);
+                    e = std::max(e, -126);
+                }
+                while (e < 127 && dequantize(node.origin[a], exp2i(e), QMAX) < frame.max[a]) ++e;
+                node.exponent[a] = e;
+                scale[a] = exp2i(e);
+            }
+
+            for (int i = 0; i < 2; ++i) {
+                node.child[i] = -1;
+                node.count[i] = 0;
+                for (int a = 0; a < 3; ++a) {
+                    node.lo[i][a] = 0;
+                    node.hi[i][a] = 0;
+                }
+                if (children[i] < 0) continue;
+
+                auto const& c = bvh_nodes[children[i]];
+                if (c.is_leaf()) {
+                    node.child[i] = c.first_prim;
+                    node.count[i] = c.prim_count;
+                }
+                else {
+                    node.child[i] = nodes.size();
+                    nodes.emplace_back();
+                    tasks.push_back({ children[i], node.child[i], task.height + 1 });
+                }
+
+                // Round outward, then step further out if float rounding put the coordinate inside.
+                for (int a = 0; a < 3; ++a) {
+                    int lo = clamp(int(std::floor((c.bound.min[a] - node.origin[a]) / scale[a])), 0, QMAX);
+                    int hi = clamp(int(std::ceil((c.bound.max[a] - node.origin[a]) / scale[a])), 0, QMAX);
+                    while (lo > 0 && dequantize(node.origin[a], scale[a], lo) > c.bound.min[a]) --lo;
+                    while (hi < QMAX && dequantize(node.origin[a], scale[a], hi) < c.bound.max[a]) ++hi;
+                    node.lo[i][a] = lo;
+                    node.hi[i][a] = hi;
+                }
+            }
+            nodes[task.idx] = node;
+        }
+    }
+
+    template <typename T>
+    Bound3f CompressedBVHAccel<T>::child_bound(CompressedBVHNode<T> const& node, int i) const {
+        Bound3f b;
+        for (int a = 0; a < 3; ++a) {
+            float scale = exp2i(node.exponent[a]);
+            b.min[a] = dequantize(node.origin[a], scale, node.lo[i][a]);
+            b.max[a] = dequantize(node.origin[a], scale, node.hi[i][a]);
+        }
+        return b;
+    }
+
+    // Slab test of both children in [t_min, t_far], returns the mask of hit children and their entry distances.
+    template <typename T>
+    int CompressedBVHAccel<T>::intersect_children(CompressedBVHNode<T> const& node, Ray const& ray, float t_far, float* t_near) const {
+        float scale[3];
+        for (int a = 0; a < 3; ++a) scale[a] = exp2i(node.exponent[a]);
+
+        int mask = 0;
+        for (int i = 0; i < 2; ++i) {
+            if (node.child[i] < 0) continue;
+            float t0 = ray.t_min;
+            float t1 = t_far;
+            for (int a = 0; a < 3; ++a) {
+                float lo = dequantize(node.origin[a], scale[a], ray.sign[a] ? node.hi[i][a] : node.lo[i][a]);
+                float hi = dequantize(node.origin[a], scale[a], ray.sign[a] ? node.lo[i][a] : node.hi[i][a]);
+                // NaN from 0 * inf keeps the previous value.
+                t0 = std::max(t0, (lo - ray.origin[a]) * ray.inv_dir[a]);
+                t1 = std::min(t1, (hi - ray.origin[a]) * ray.inv_dir[a]);
+            }
+            t_near[i] = t0;
+            if (t0 <= t1) mask |= 1 << i;
+        }
+        return mask;
+    }
+
+    template <typename T>
+    typename CompressedBVHAccel<T>::StackEntry* CompressedBVHAccel<T>::get_stack() const {
+        thread_local std::vector<StackEntry> stack;
+        if ((int)stack.size() < stack_size) stack.resize(stack_size);
+        return stack.data();
+    }
+
+    template <typename T>
+    void CompressedBVHAccel<T>::intersect(Ray& ray, Intersection& isect) {
+        auto const& prims = leaf_objects();
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { 0, 0, 0.f };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+            if (beyond_closest_hit(e.t, isect)) continue;
+
+            if (e.count > 0) {
+                for (int i = 0; i < e.count; ++i) {
+                    TRAVERSAL_STATS_PRIM();
+                    prims[e.child + i]->intersect(ray, isect);
+                }
+                continue;
+            }
+
+            auto const& node = nodes[e.child];
+            TRAVERSAL_STATS_NODE();
+
+            float t_near[2];
+            int mask = intersect_children(node, ray, closest_hit_limit(isect), t_near);
+
+            // Push the farther child first so that the nearer one is popped first.
+            int first = mask == 3 && t_near[1] > t_near[0] ? 1 : 0;
+            for (int j = 0; j < 2; ++j) {
+                int i = first ^ j;
+                if (mask & (1 << i)) stack[ptr++] = { node.child[i], node.count[i], t_near[i] };
+            }
+        }
+
+        TRAVERSAL_STATS_RAY();
+    }
+
+    template <typename T>
+    bool CompressedBVHAccel<T>::occluded(Ray& ray, float t_max) {
+        auto const& prims = leaf_objects();
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { 0, 0, 0.f };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+
+            if (e.count > 0) {
+                for (int i = 0; i < e.count; ++i) {
+                    TRAVERSAL_STATS_PRIM();
+                    if (prims[e.child + i]->occluded(ray, t_max)) {
+                        last_occluder = prims[e.child + i];
+                        TRAVERSAL_STATS_RAY();
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            auto const& node = nodes[e.child];
+            TRAVERSAL_STATS_NODE();
+
+            float t_near[2];
+            int mask = intersect_children(node, ray, t_max, t_near);
+            for (int i = 0; i < 2; ++i) {
+                if (mask & (1 << i)) stack[ptr++] = { node.child[i], node.count[i], t_near[i] };
+            }
+        }
+
+        TRAVERSAL_STATS_RAY();
+        return false;
+    }
+
+    template <typename T>
+    void CompressedBVHAccel<T>::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
+        bound.draw_wireframe(image, transform, color);
+        for (auto const& node : nodes) {
+            for (int i = 0; i < 2; ++i) {
+                if (node.child[i] >= 0) child_bound(node, i).draw_wireframe(image, transform, color);
+            }
+        }
+    }
+
+    template struct CompressedBVHAccel<uint8_t>;
+    template struct CompressedBVHAccel<uint16_t>;
+
+} // namespace tira
@@ -0,0 +1,85 @@
+//
+// Created by Ziyi.Lu 2023/04/24
+//
+
+#ifndef CBVH_H
+#define CBVH_H
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <scene/bvh.h>
+
+namespace tira {
+
+    /**
+     * Node of compressed BVH holding the bounds of its two children quantized to T.
+     * The node bound is the frame origin + [0, QMAX] * 2^exponent on each axis,
+     * child bounds are integer coordinates in that frame rounded outward.
+     */
+    template <typename T>
+    struct CompressedBVHNode {
+        float origin[3];
+        // Index of inner child node or first primitive of leaf child, -1 for empty slot.
+        int child[2];
+        // Primitive count of leaf child, 0 for inner child.
+        uint16_t count[2];
+        int8_t exponent[3];
+        T lo[2][3];
+        T hi[2][3];
+    };
+
+    /**
+     * Binary BVH with quantized child bounds, converted from a BVHAccel built with the given split method.
+     * Only inner nodes are stored since leaves live in the slots of their parent, which together with
+     * the quantization takes a fraction of the memory of BVHNode.
+     * Dequantized bounds always contain the exact ones, so traversal may visit more nodes but misses no hit.
+     */
+    template <typename T>
+    struct CompressedBVHAccel : Accelerator {
+        static constexpr int QMAX = std::numeric_limits<T>::max();
+
+        std::vector<CompressedBVHNode<T>> nodes;
+        // Leaf references of the binary BVH when it is built with spatial splits, see BVHAccel::references.
+        std::vector<Object*> references;
+        BVHAccel::SplitMethod split_method;
+        int max_objs;
+        int max_height;
+        int stack_size = 0;
+
+        CompressedBVHAccel(int _max_objs = 2, BVHAccel::SplitMethod _split_method = BVHAccel::DEFAULT_SPLIT_METHOD)
+            : split_method(_split_method)
+            , max_objs(_max_objs) {}
+        ~CompressedBVHAccel() {}
+
+        virtual void build(std::vector<Object*>&& objects) override;
+        virtual void intersect(Ray& ray, Intersection& isect) override;
+        virtual bool occluded(Ray& ray, float t_max) override;
+        virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override;
+
+        std::vector<Object*> const& leaf_objects() const { return references.empty() ? objects : references; }
+
+        // Bound of child i of node, as seen by traversal.
+        Bound3f child_bound(CompressedBVHNode<T> const& node, int i) const;
+
+    private:
+        struct StackEntry {
+            int child;
+            int count;
+            float t;
+        };
+
+        void compress(std::vector<BVHNode> const& bvh_nodes);
+        int intersect_children(CompressedBVHNode<T> const& node, Ray const& ray, float t_far, float* t_near) const;
+        StackEntry* get_stack() const;
+    };
+
+    using CompressedBVH8Accel = CompressedBVHAccel<uint8_t>;
+    using CompressedBVH16Accel = CompressedBVHAccel<uint16_t>;
+
+    extern template struct CompressedBVHAccel<uint8_t>;
+    extern template struct CompressedBVHAccel<uint16_t>;
+
+} // namespace tira
+
+#endif
@@ -0,0 +1,300 @@
+//
+// Created by Ziyi.Lu 2023/04/22
+//
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <scene/grid.h>
+#include <misc/timer.h>
+
+namespace tira {
+
+    void Grid::build(std::vector<Object*> const& objects, Bound3f const& _bound, float density) {
+        int n = objects.size();
+
+        // Pad the bound so that no cell is flat and objects on the boundary fall inside.
+        bound = _bound;
+        float3 extent = bound.get_extent();
+        float max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+        float pad = (max_extent > 0 ? max_extent : 1.f) * 1e-4f;
+        bound.min -= float3(pad);
+        bound.max += float3(pad);
+        extent = bound.get_extent();
+
+        // About density cells per object, shaped after the bound.
+        float k = std::cbrt(density * std::max(n, 1) / (extent.x * extent.y * extent.z));
+        for (int a = 0; a < 3; ++a) {
+            res[a] = clamp(int(extent[a] * k), 1, GRID_MAX_RESOLUTION);
+            cell_size[a] = extent[a] / res[a];
+            inv_cell_size[a] = res[a] / extent[a];
+        }
+
+        auto cell_range = [&](Object const* o, int3& lo, int3& hi) {
+            auto b = o->get_bound();
+            for (int a = 0; a < 3; ++a) {
+                lo[a] = clamp(int((b.min[a] - bound.min[a]) * inv_cell_size[a]), 0, res[a] - 1);
+                hi[a] = clamp(int((b.max[a] - bound.min[a]) * inv_cell_size[a]), 0, res[a] - 1);
+            }
+        };
+
+        // Counting sort of references by cell: count, prefix sum, then scatter with the counters as cursors.
+        int cells = cell_count();
+        std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[cells]);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < cells; ++i) counts[i] = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < n; ++i) {
+            int3 lo, hi;
+            cell_range(objects[i], lo, hi);
+            for (int z = lo.z; z <= hi.z; ++z) for (int y = lo.y; y <= hi.y; ++y) for (int x = lo.x; x <= hi.x; ++x) {
+                counts[cell_index(x, y, z)].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        cell_start.resize(cells + 1);
+        cell_start[0] = 0;
+        for (int i = 0; i < cells; ++i) {
+            cell_start[i + 1] = cell_start[i] + counts[i];
+            counts[i] = cell_start[i];
+        }
+
+        references.resize(cell_start[cells]);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < n; ++i) {
+            int3 lo, hi;
+            cell_range(objects[i], lo, hi);
+            for (int z = lo.z; z <= hi.z; ++z) for (int y = lo.y; y <= hi.y; ++y) for (int x = lo.x; x <= hi.x; ++x) {
+                references[counts[cell_index(x, y, z)].fetch_add(1, std::memory_order_relaxed)] = objects[i];
+            }
+        }
+    }
+
+    Bound3f Grid::cell_bound(int x, int y, int z) const {
+        float3 min = bound.min + float3(x, y, z) * cell_size;
+        return Bound3f(min, min + cell_size);
+    }
+
+    /**
+     * 3D-DDA over the cells the ray passes through in [t0, t1], front-to-back.
+     * visit(cell, t_enter, t_exit) returns true to stop, which is returned.
+     */
+    template <typename Visit>
+    static bool traverse(Grid const& grid, Ray const& ray, float t0, float t1, Visit&& visit) {
+        float3 p = ray.at(t0);
+        int3 cell, step;
+        float3 t_next, t_delta;
+        for (int a = 0; a < 3; ++a) {
+            cell[a] = clamp(int((p[a] - grid.bound.min[a]) * grid.inv_cell_size[a]), 0, grid.res[a] - 1);
+            if (ray.direction[a] > 0) {
+                step[a] = 1;
+                t_next[a] = (grid.bound.min[a] + (cell[a] + 1) * grid.cell_size[a] - ray.origin[a]) * ray.inv_dir[a];
+                t_delta[a] = grid.cell_size[a] * ray.inv_dir[a];
+            }
+            else if (ray.direction[a] < 0) {
+                step[a] = -1;
+                t_next[a] = (grid.bound.min[a] + cell[a] * grid.cell_size[a] - ray.origin[a]) * ray.inv_dir[a];
+                t_delta[a] = -grid.cell_size[a] * ray.inv_dir[a];
+            }
+            else {
+                step[a] = 0;
+                t_next[a] = FLOAT_MAX;
+                t_delta[a] = 0.f;
+            }
+        }
+
+        float t = t0;
+        while (true) {
+            int axis = t_next.x < t_next.y ? (t_next.x < t_next.z ? 0 : 2) : (t_next.y < t_next.z ? 1 : 2);
+            if (visit(grid.cell_index(cell.x, cell.y, cell.z), t, std::min(t_next[axis], t1))) return true;
+            if (t_next[axis] > t1) return false;
+
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= grid.res[axis]) return false;
+            t = t_next[axis];
+            t_next[axis] += t_delta[axis];
+        }
+    }
+
+    // Direct mapped cache of objects tested by the current ray of a thread, a collision only costs a repeated test.
+    struct Mailbox {
+        Object const* objects[GRID_MAILBOX_SIZE] = { nullptr };
+        uint32_t rays[GRID_MAILBOX_SIZE] = { 0 };
+        uint32_t ray = 0;
+
+        void next_ray() {
+            if (++ray == 0) {
+                std::fill(rays, rays + GRID_MAILBOX_SIZE, 0);
+                ray = 1;
+            }
+        }
+
+        // Whether o is already tested by the current ray, marks it tested otherwise.
+        bool test_and_set(Object const* o) {
+            auto h = (reinterpret_cast<uintptr_t>(o) >> 4) % GRID_MAILBOX_SIZE;
+            if (rays[h] == ray && objects[h] == o) return true;
+            rays[h] = ray;
+            objects[h] = o;
+            return false;
+        }
+    };
+
+    static Mailbox& get_mailbox() {
+        thread_local Mailbox mailbox;
+        return mailbox;
+    }
+
+    void GridAccel::build(std::vector<Object*>&& _objects) {
+        objects = std::move(_objects);
+        int n = objects.size();
+
+        Timer timer;
+
+        bound = Bound3f();
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        {
+            Bound3f local_bound;
+#ifdef _OPENMP
+#pragma omp for nowait
+#endif
+            for (int i = 0; i < n; ++i) {
+                local_bound += objects[i]->get_bound();
+            }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            bound += local_bound;
+        }
+
+        grid.build(objects, bound, GRID_DENSITY);
+        cell_sub_grid.assign(grid.cell_count(), -1);
+        sub_grids.clear();
+
+#ifdef GRID_TWO_LEVEL
+        std::vector<int> dense_cells;
+        for (int i = 0; i < grid.cell_count(); ++i) {
+            if (grid.cell_start[i + 1] - grid.cell_start[i] > GRID_MAX_CELL_OBJECTS) {
+                cell_sub_grid[i] = dense_cells.size();
+                dense_cells.push_back(i);
+            }
+        }
+
+        sub_grids.resize(dense_cells.size());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int i = 0; i < (int)dense_cells.size(); ++i) {
+            int cell = dense_cells[i];
+            int x = cell % grid.res.x;
+            int y = cell / grid.res.x % grid.res.y;
+            int z = cell / grid.res.x / grid.res.y;
+            std::vector<Object*> cell_objects(grid.references.begin() + grid.cell_start[cell], grid.references.begin() + grid.cell_start[cell + 1]);
+            sub_grids[i].build(cell_objects, grid.cell_bound(x, y, z), GRID_DENSITY);
+        }
+
+        // Objects spanning most of their cell are not separated by nesting, such sub grids are dropped.
+        std::vector<Grid> kept;
+        for (int i = 0; i < (int)dense_cells.size(); ++i) {
+            auto& g = sub_grids[i];
+            int count = grid.cell_start[dense_cells[i] + 1] - grid.cell_start[dense_cells[i]];
+            if (g.references.size() * 2 < (size_t)g.cell_count() * count) {
+                cell_sub_grid[dense_cells[i]] = kept.size();
+                kept.push_back(std::move(g));
+            }
+            else {
+                cell_sub_grid[dense_cells[i]] = -1;
+            }
+        }
+        sub_grids.swap(kept);
+#endif
+
+        size_t references = grid.references.size();
+        for (auto const& g : sub_grids) references += g.references.size();
+
+        timer.update();
+        std::cout << "[Tira] " << "Grid build time: " << timer.delta_time() << "s, resolution: "
+            << grid.res.x << "x" << grid.res.y << "x" << grid.res.z << ", sub grids: " << sub_grids.size()
+            << ", references: " << references << " (" << n << " objects)\n";
+    }
+
+    void GridAccel::intersect(Ray& ray, Intersection& isect) {
+        float t0, t1;
+        if (!bound.intersect(ray, t0, t1)) {
+            TRAVERSAL_STATS_RAY();
+            return;
+        }
+
+        auto& mailbox = get_mailbox();
+        mailbox.next_ray();
+
+        // Stop once no later cell can hold a closer hit.
+        auto test_cell = [&](Grid const& g, int cell, float t_exit) {
+            TRAVERSAL_STATS_NODE();
+            for (int i = g.cell_start[cell]; i < g.cell_start[cell + 1]; ++i) {
+                if (mailbox.test_and_set(g.references[i])) continue;
+                TRAVERSAL_STATS_PRIM();
+                g.references[i]->intersect(ray, isect);
+            }
+            return beyond_closest_hit(t_exit, isect);
+        };
+
+        traverse(grid, ray, t0, t1, [&](int cell, float t_enter, float t_exit) {
+            int sub = cell_sub_grid[cell];
+            if (sub < 0) return test_cell(grid, cell, t_exit);
+            return traverse(sub_grids[sub], ray, t_enter, t_exit, [&](int sub_cell, float, float sub_exit) {
+                return test_cell(sub_grids[sub], sub_cell, sub_exit);
+            });
+        });
+        TRAVERSAL_STATS_RAY();
+    }
+
+    bool GridAccel::occluded(Ray& ray, float t_max) {
+        float t0, t1;
+        if (!bound.intersect(ray, t0, t1) || t0 > t_max) {
+            TRAVERSAL_STATS_RAY();
+            return false;
+        }
+        t1 = std::min(t1, t_max);
+
+        auto& mailbox = get_mailbox();
+        mailbox.next_ray();
+
+        auto test_cell = [&](Grid const& g, int cell) {
+            TRAVERSAL_STATS_NODE();
+            for (int i = g.cell_start[cell]; i < g.cell_start[cell + 1]; ++i) {
+                if (mailbox.test_and_set(g.references[i])) continue;
+                TRAVERSAL_STATS_PRIM();
+                if (g.references[i]->occluded(ray, t_max)) {
+                    last_occluder = g.references[i];
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        bool hit = traverse(grid, ray, t0, t1, [&](int cell, float t_enter, float t_exit) {
+            int sub = cell_sub_grid[cell];
+            if (sub < 0) return test_cell(grid, cell);
+            return traverse(sub_grids[sub], ray, t_enter, t_exit, [&](int sub_cell, float, float) {
+                return test_cell(sub_grids[sub], sub_cell);
+            });
+        });
+        TRAVERSAL_STATS_RAY();
+        return hit;
+    }
+
+    void GridAccel::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
+        grid.bound.draw_wireframe(image, transform, color);
+        for (auto const& g : sub_grids) g.bound.draw_wireframe(image, transform, color);
+    }
+
+} // namespace tira
@@ -0,0 +1,53 @@
+//
+// Created by Ziyi.Lu 2023/04/22
+//
+
+#ifndef GRID_H
+#define GRID_H
+
+#include <vector>
+#include <scene/accel.h>
+#include <misc/utils.h>
+#include <misc/image.h>
+#include <geometry/object.h>
+
+namespace tira {
+
+    // Cells of a uniform grid, references of cell i are [cell_start[i], cell_start[i + 1]).
+    struct Grid {
+        Bound3f bound;
+        int3 res;
+        float3 cell_size;
+        float3 inv_cell_size;
+        std::vector<int> cell_start;
+        std::vector<Object*> references;
+
+        void build(std::vector<Object*> const& objects, Bound3f const& _bound, float density);
+        int cell_index(int x, int y, int z) const { return (z * res.y + y) * res.x + x; }
+        int cell_count() const { return res.x * res.y * res.z; }
+        Bound3f cell_bound(int x, int y, int z) const;
+    };
+
+    /**
+     * Uniform grid with an O(N) parallel counting sort build, traversed by 3D-DDA.
+     * With GRID_TWO_LEVEL, cells holding more than GRID_MAX_CELL_OBJECTS references get a nested grid.
+     * An object overlapping several cells is tested once per ray thanks to a per-thread mailbox.
+     */
+    struct GridAccel : Accelerator {
+        Grid grid;
+        std::vector<Grid> sub_grids;
+        // Nested grid of every top cell, -1 if none.
+        std::vector<int> cell_sub_grid;
+
+        GridAccel() {}
+        ~GridAccel() {}
+
+        virtual void build(std::vector<Object*>&& objects) override;
+        virtual void intersect(Ray& ray, Intersection& isect) override;
+        virtual bool occluded(Ray& ray, float t_max) override;
+        virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override;
+    };
+
+} // namespace tira
+
+#endif
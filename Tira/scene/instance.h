@@ -0,0 +1,151 @@
+//
+// Created by Ziyi.Lu 2023/04/18
+//
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <memory>
+#include <math/matrix.h>
+#include <geometry/object.h>
+#include <scene/bvh.h>
+
+namespace tira {
+
+    /**
+     * Placement of a shared mesh, which is built once into a bottom-level BVH in object space.
+     * The top-level accelerator holds instances as objects, rays are transformed into object space at its leaves.
+     * Local rays are normalized, so distances are scaled into object space and back around the bottom-level query.
+     * Instances are not sampled as lights, so scenes with emissive instanced shapes are rejected at load.
+     */
+    struct Instance : Object {
+        std::shared_ptr<BVHAccel> mesh;
+        // Object to world: linear * p + translation.
+        float3x3 linear;
+        float3x3 inv_linear;
+        float3 translation;
+        Bound3f bound;
+
+        Instance(std::shared_ptr<BVHAccel> const& _mesh, float3x3 const& _linear, float3 const& _translation)
+            : mesh(_mesh)
+            , linear(_linear)
+            , translation(_translation) {
+            update_geometry();
+        }
+        virtual ~Instance() {}
+
+        // scale is the length of the ray direction in object space, object distance = world distance * scale.
+        Ray to_local(Ray const& ray, float& scale) const {
+            float3 d = inv_linear * ray.direction;
+            scale = d.norm();
+            Ray local(inv_linear * (ray.origin - translation), d, ray.t_min * scale);
+            local.shadow_ray = ray.shadow_ray;
+            return local;
+        }
+
+        float3 normal_to_world(float3 const& n) const {
+            return normalize(float3(inv_linear.col[0].dot(n), inv_linear.col[1].dot(n), inv_linear.col[2].dot(n)));
+        }
+
+        float4x4 get_transform() const {
+            return float4x4(
+                float4(linear.col[0], 0.f),
+                float4(linear.col[1], 0.f),
+                float4(linear.col[2], 0.f),
+                float4(translation, 1.f));
+        }
+
+        virtual void intersect(Ray const& ray, Intersection& isect) const override {
+            float scale;
+            Ray local = to_local(ray, scale);
+
+            // Any hit in the mesh clears isect.instance, see Triangle::record_hit.
+            Object* prev_instance = isect.instance;
+            float world_distance = isect.distance;
+            isect.instance = (Object*)this;
+            isect.distance = world_distance * scale;
+            mesh->intersect(local, isect);
+
+            if (isect.instance == nullptr) {
+                isect.instance = (Object*)this;
+                isect.distance /= scale;
+            }
+            else {
+                isect.instance = prev_instance;
+                isect.distance = world_distance;
+            }
+        }
+
+        virtual void compute_surface_interaction(Ray const& ray, Intersection& isect) const override {
+            float scale;
+            Ray local = to_local(ray, scale);
+
+            float world_distance = isect.distance;
+            isect.distance = world_distance * scale;
+            isect.object->compute_surface_interaction(local, isect);
+            isect.distance = world_distance;
+
+            isect.position = ray.at(world_distance);
+            isect.normal = normal_to_world(isect.normal);
+            isect.tangent = linear * isect.tangent;
+            isect.bitangent = linear * isect.bitangent;
+        }
+
+        virtual bool occluded(Ray const& ray, float t_max) const override {
+            float scale;
+            Ray local = to_local(ray, scale);
+            return mesh->occluded(local, t_max * scale);
+        }
+
+        virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override {
+            auto instance_transform = transform * get_transform();
+            for (auto const& o : mesh->objects) {
+                o->draw_wireframe(image, instance_transform, color);
+            }
+        }
+
+        virtual void sample(Intersection& isect, float& pdf) const override {
+            // Pass, instances are never lights.
+            isect.hit = false;
+            pdf = 0.f;
+        }
+
+        virtual void update_geometry() override {
+            inv_linear = linear.inversed();
+
+            bound = Bound3f();
+            auto const& b = mesh->bound;
+            for (int i = 0; i < 8; ++i) {
+                float3 corner = {
+                    (i & 1) ? b.max.x : b.min.x,
+                    (i & 2) ? b.max.y : b.min.y,
+                    (i & 4) ? b.max.z : b.min.z,
+                };
+                bound += linear * corner + translation;
+            }
+        }
+
+        virtual float3 get_center() const override {
+            return bound.get_center();
+        }
+
+        virtual float3 get_min() const override {
+            return bound.min;
+        }
+
+        virtual float3 get_max() const override {
+            return bound.max;
+        }
+
+        virtual Bound3f get_bound() const override {
+            return bound;
+        }
+
+        virtual float get_area() const override {
+            return 0.f;
+        }
+    };
+
+} // namespace tira
+
+#endif
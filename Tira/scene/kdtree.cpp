@@ -0,0 +1,366 @@
+//
+// Created by Ziyi.Lu 2023/04/20
+//
+
+#include <cmath>
+#include <algorithm>
+#include <scene/kdtree.h>
+#include <misc/timer.h>
+
+namespace tira {
+
+    struct KdEvent {
+        // At the same position, ends come before planes and planes before starts.
+        enum Type { END, PLANAR, START };
+
+        float pos;
+        int prim;
+        int axis;
+        Type type;
+
+        // Events of one axis are contiguous so that one sweep evaluates every axis.
+        bool operator<(KdEvent const& other) const {
+            if (axis != other.axis) return axis < other.axis;
+            if (pos != other.pos) return pos < other.pos;
+            return type < other.type;
+        }
+    };
+
+    // Object with its bound clipped to the current node.
+    struct KdPrim {
+        int prim;
+        Bound3f bound;
+    };
+
+    static void add_events(std::vector<KdEvent>& events, KdPrim const& p) {
+        for (int a = 0; a < 3; ++a) {
+            if (p.bound.min[a] == p.bound.max[a]) {
+                events.push_back({ p.bound.min[a], p.prim, a, KdEvent::PLANAR });
+            }
+            else {
+                events.push_back({ p.bound.min[a], p.prim, a, KdEvent::START });
+                events.push_back({ p.bound.max[a], p.prim, a, KdEvent::END });
+            }
+        }
+    }
+
+    static Bound3f clip(Bound3f const& b, Bound3f const& voxel) {
+        return Bound3f(float3::max(b.min, voxel.min), float3::min(b.max, voxel.max));
+    }
+
+    struct KdTreeBuilder {
+        enum Side { LEFT, RIGHT, BOTH };
+
+        std::vector<KdTreeNode>& nodes;
+        std::vector<Object*>& references;
+        std::vector<Object*> const& objects;
+        int max_objs;
+        int max_depth;
+        int depth_reached = 0;
+        // Side of every object for the split being applied.
+        std::vector<Side> side;
+
+        void make_leaf(int idx, std::vector<KdPrim> const& prims);
+        void subdivide(int idx, Bound3f const& voxel, std::vector<KdPrim>& prims, std::vector<KdEvent>& events, int depth);
+    };
+
+    void KdTreeBuilder::make_leaf(int idx, std::vector<KdPrim> const& prims) {
+        auto& node = nodes[idx];
+        node.axis = 3;
+        node.above_child = 0;
+        node.split = 0.f;
+        node.first_prim = references.size();
+        node.prim_count = prims.size();
+        for (auto const& p : prims) references.push_back(objects[p.prim]);
+    }
+
+    void KdTreeBuilder::subdivide(int idx, Bound3f const& voxel, std::vector<KdPrim>& prims, std::vector<KdEvent>& events, int depth) {
+        int n = prims.size();
+        if (depth > depth_reached) depth_reached = depth;
+
+        float area = voxel.get_surface_area();
+        if (n <= max_objs || depth >= max_depth || area <= 0) {
+            make_leaf(idx, prims);
+            return;
+        }
+
+        // Sweep the sorted events, counting objects left of, in and right of every candidate plane.
+        float inv_area = 1.f / area;
+        float best_cost = KdTreeAccel::INTERSECT_COST * n;
+        int best_axis = -1;
+        float best_pos = 0.f;
+        bool best_planar_left = false;
+
+        int nl[3] = { 0, 0, 0 };
+        int nr[3] = { n, n, n };
+        for (size_t i = 0; i < events.size();) {
+            int k = events[i].axis;
+            float p = events[i].pos;
+            int ends = 0, planes = 0, starts = 0;
+            while (i < events.size() && events[i].axis == k && events[i].pos == p && events[i].type == KdEvent::END) { ++ends; ++i; }
+            while (i < events.size() && events[i].axis == k && events[i].pos == p && events[i].type == KdEvent::PLANAR) { ++planes; ++i; }
+            while (i < events.size() && events[i].axis == k && events[i].pos == p && events[i].type == KdEvent::START) { ++starts; ++i; }
+
+            nr[k] -= planes + ends;
+
+            // Planes on the node boundary cut off nothing.
+            if (p > voxel.min[k] && p < voxel.max[k]) {
+                Bound3f left = voxel;
+                Bound3f right = voxel;
+                left.max[k] = p;
+                right.min[k] = p;
+                float pl = left.get_surface_area() * inv_area;
+                float pr = right.get_surface_area() * inv_area;
+
+                auto cost = [&](int l, int r) {
+                    float c = KdTreeAccel::TRAVERSAL_COST + KdTreeAccel::INTERSECT_COST * (pl * l + pr * r);
+                    return l == 0 || r == 0 ? c * (1.f - KdTreeAccel::EMPTY_BONUS) : c;
+                };
+                float cost_left = cost(nl[k] + planes, nr[k]);
+                float cost_right = cost(nl[k], nr[k] + planes);
+                float c = std::min(cost_left, cost_right);
+                if (c < best_cost) {
+                    best_cost = c;
+                    best_axis = k;
+                    best_pos = p;
+                    best_planar_left = cost_left <= cost_right;
+                }
+            }
+
+            nl[k] += starts + planes;
+        }
+
+        if (best_axis < 0) {
+            make_leaf(idx, prims);
+            return;
+        }
+
+        // Classify objects by their events on the split axis, objects without a deciding event straddle the plane.
+        for (auto const& p : prims) side[p.prim] = BOTH;
+        for (auto const& e : events) {
+            if (e.axis != best_axis) continue;
+            if (e.type == KdEvent::END && e.pos <= best_pos) side[e.prim] = LEFT;
+            else if (e.type == KdEvent::START && e.pos >= best_pos) side[e.prim] = RIGHT;
+            else if (e.type == KdEvent::PLANAR) {
+                if (e.pos < best_pos || (e.pos == best_pos && best_planar_left)) side[e.prim] = LEFT;
+                else side[e.prim] = RIGHT;
+            }
+        }
+
+        Bound3f left_voxel = voxel;
+        Bound3f right_voxel = voxel;
+        left_voxel.max[best_axis] = best_pos;
+        right_voxel.min[best_axis] = best_pos;
+
+        // Events of one-sided objects keep their order, clipped straddling objects need their events sorted and merged in.
+        std::vector<KdPrim> left_prims, right_prims;
+        std::vector<KdEvent> left_events, right_events;
+        std::vector<KdEvent> left_new, right_new;
+        for (auto const& p : prims) {
+            switch (side[p.prim]) {
+            case LEFT: left_prims.push_back(p); break;
+            case RIGHT: right_prims.push_back(p); break;
+            case BOTH: {
+                KdPrim l = { p.prim, clip(p.bound, left_voxel) };
+                KdPrim r = { p.prim, clip(p.bound, right_voxel) };
+                left_prims.push_back(l);
+                right_prims.push_back(r);
+                add_events(left_new, l);
+                add_events(right_new, r);
+            } break;
+            }
+        }
+        for (auto const& e : events) {
+            if (side[e.prim] == LEFT) left_events.push_back(e);
+            else if (side[e.prim] == RIGHT) right_events.push_back(e);
+        }
+        std::vector<KdPrim>().swap(prims);
+        std::vector<KdEvent>().swap(events);
+
+        std::sort(left_new.begin(), left_new.end());
+        std::sort(right_new.begin(), right_new.end());
+        std::vector<KdEvent> merged;
+        merged.reserve(left_events.size() + left_new.size());
+        std::merge(left_events.begin(), left_events.end(), left_new.begin(), left_new.end(), std::back_inserter(merged));
+        left_events.swap(merged);
+        merged.clear();
+        merged.reserve(right_events.size() + right_new.size());
+        std::merge(right_events.begin(), right_events.end(), right_new.begin(), right_new.end(), std::back_inserter(merged));
+        right_events.swap(merged);
+        std::vector<KdEvent>().swap(merged);
+
+        nodes[idx].axis = best_axis;
+        nodes[idx].split = best_pos;
+        nodes[idx].first_prim = nodes[idx].prim_count = 0;
+
+        // Below child follows its parent, above child follows the subtree of below child.
+        nodes.push_back(KdTreeNode{});
+        subdivide(idx + 1, left_voxel, left_prims, left_events, depth + 1);
+        nodes[idx].above_child = nodes.size();
+        nodes.push_back(KdTreeNode{});
+        subdivide(nodes[idx].above_child, right_voxel, right_prims, right_events, depth + 1);
+    }
+
+    void KdTreeAccel::build(std::vector<Object*>&& _objects) {
+        objects = std::move(_objects);
+        nodes.clear();
+        references.clear();
+
+        Timer timer;
+
+        int n = objects.size();
+        std::vector<KdPrim> prims(n);
+        std::vector<KdEvent> events;
+        events.reserve(n * 6);
+        bound = Bound3f();
+        for (int i = 0; i < n; ++i) {
+            prims[i] = { i, objects[i]->get_bound() };
+            bound += prims[i].bound;
+            add_events(events, prims[i]);
+        }
+        std::sort(events.begin(), events.end());
+
+        max_depth = n > 0 ? std::round(8 + 1.3f * std::log2(n)) : 0;
+
+        KdTreeBuilder builder{ nodes, references, objects, max_objs, max_depth, 0, std::vector<KdTreeBuilder::Side>(n) };
+        nodes.push_back(KdTreeNode{});
+        builder.subdivide(0, bound, prims, events, 0);
+        max_depth = builder.depth_reached;
+
+        timer.update();
+        std::cout << "[Tira] " << "kd-tree build time: " << timer.delta_time() << "s, nodes: " << nodes.size()
+            << ", references: " << references.size() << " (" << n << " objects), max depth: " << max_depth << "\n";
+    }
+
+    typename KdTreeAccel::StackEntry* KdTreeAccel::get_stack() const {
+        thread_local std::vector<StackEntry> stack;
+        if ((int)stack.size() < max_depth + 1) stack.resize(max_depth + 1);
+        return stack.data();
+    }
+
+    void KdTreeAccel::intersect(Ray& ray, Intersection& isect) {
+        float t0, t1;
+        if (!bound.intersect(ray, t0, t1)) {
+            TRAVERSAL_STATS_RAY();
+            return;
+        }
+
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { 0, t0, t1 };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+            int idx = e.node;
+            t0 = e.t0;
+            t1 = e.t1;
+
+            // Descend to the nearest leaf, deferring the far side of every plane inside [t0, t1].
+            while (!beyond_closest_hit(t0, isect)) {
+                TRAVERSAL_STATS_NODE();
+                auto const& node = nodes[idx];
+                if (node.is_leaf()) {
+                    for (int i = 0; i < node.prim_count; ++i) {
+                        TRAVERSAL_STATS_PRIM();
+                        references[node.first_prim + i]->intersect(ray, isect);
+                    }
+                    break;
+                }
+
+                int axis = node.axis;
+                float t_plane = (node.split - ray.origin[axis]) * ray.inv_dir[axis];
+                bool below_first = ray.origin[axis] < node.split || (ray.origin[axis] == node.split && ray.direction[axis] <= 0);
+                int first = below_first ? idx + 1 : node.above_child;
+                int second = below_first ? node.above_child : idx + 1;
+
+                if (ray.direction[axis] == 0 || t_plane > t1 || t_plane <= 0) {
+                    idx = first;
+                }
+                else if (t_plane < t0) {
+                    idx = second;
+                }
+                else {
+                    stack[ptr++] = { second, t_plane, t1 };
+                    idx = first;
+                    t1 = t_plane;
+                }
+            }
+        }
+        TRAVERSAL_STATS_RAY();
+    }
+
+    bool KdTreeAccel::occluded(Ray& ray, float t_max) {
+        float t0, t1;
+        if (!bound.intersect(ray, t0, t1) || t0 > t_max) {
+            TRAVERSAL_STATS_RAY();
+            return false;
+        }
+
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { 0, t0, t1 };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+            int idx = e.node;
+            t0 = e.t0;
+            t1 = e.t1;
+
+            while (t0 <= t_max) {
+                TRAVERSAL_STATS_NODE();
+                auto const& node = nodes[idx];
+                if (node.is_leaf()) {
+                    for (int i = 0; i < node.prim_count; ++i) {
+                        TRAVERSAL_STATS_PRIM();
+                        if (references[node.first_prim + i]->occluded(ray, t_max)) {
+                            last_occluder = references[node.first_prim + i];
+                            TRAVERSAL_STATS_RAY();
+                            return true;
+                        }
+                    }
+                    break;
+                }
+
+                int axis = node.axis;
+                float t_plane = (node.split - ray.origin[axis]) * ray.inv_dir[axis];
+                bool below_first = ray.origin[axis] < node.split || (ray.origin[axis] == node.split && ray.direction[axis] <= 0);
+                int first = below_first ? idx + 1 : node.above_child;
+                int second = below_first ? node.above_child : idx + 1;
+
+                if (ray.direction[axis] == 0 || t_plane > t1 || t_plane <= 0) {
+                    idx = first;
+                }
+                else if (t_plane < t0) {
+                    idx = second;
+                }
+                else {
+                    stack[ptr++] = { second, t_plane, t1 };
+                    idx = first;
+                    t1 = t_plane;
+                }
+            }
+        }
+        TRAVERSAL_STATS_RAY();
+        return false;
+    }
+
+    void KdTreeAccel::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
+        if (!nodes.empty()) draw_wireframe_node(image, transform, color, 0, bound);
+    }
+
+    void KdTreeAccel::draw_wireframe_node(Image& image, float4x4 const& transform, colorf const& color, int idx, Bound3f const& voxel) const {
+        auto const& node = nodes[idx];
+        if (node.is_leaf()) {
+            voxel.draw_wireframe(image, transform, color);
+            return;
+        }
+
+        Bound3f below = voxel;
+        Bound3f above = voxel;
+        below.max[node.axis] = node.split;
+        above.min[node.axis] = node.split;
+        draw_wireframe_node(image, transform, color, idx + 1, below);
+        draw_wireframe_node(image, transform, color, node.above_child, above);
+    }
+
+} // namespace tira
@@ -0,0 +1,66 @@
+//
+// Created by Ziyi.Lu 2023/04/20
+//
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <vector>
+#include <scene/accel.h>
+#include <misc/utils.h>
+#include <misc/image.h>
+#include <geometry/object.h>
+
+namespace tira {
+
+    // Below child is stored right after its parent, above child at above_child.
+    struct KdTreeNode {
+        float split;
+        // 0, 1, 2 for split axis, 3 for leaf.
+        int axis;
+        int above_child;
+        int first_prim, prim_count;
+
+        bool is_leaf() const { return axis == 3; }
+    };
+
+    /**
+     * SAH kd-tree as in: Ingo Wald and Vlastimil Havran, On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N).
+     * Split candidates are the bound planes of objects clipped to the node, swept in one presorted event list,
+     * objects lying in a candidate plane go to the cheaper side.
+     * An object may be referenced by several leaves, traversal is front-to-back with a short stack.
+     */
+    struct KdTreeAccel : Accelerator {
+        std::vector<KdTreeNode> nodes;
+        // Leaf references into objects.
+        std::vector<Object*> references;
+        int max_objs;
+        int max_depth = 0;
+
+        static constexpr float TRAVERSAL_COST = 1.f;
+        static constexpr float INTERSECT_COST = 1.5f;
+        // Cost reduction of splits that cut off empty space.
+        static constexpr float EMPTY_BONUS = .2f;
+
+        KdTreeAccel(int _max_objs = 2)
+            : max_objs(_max_objs) {}
+        ~KdTreeAccel() {}
+
+        virtual void build(std::vector<Object*>&& objects) override;
+        virtual void intersect(Ray& ray, Intersection& isect) override;
+        virtual bool occluded(Ray& ray, float t_max) override;
+        virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override;
+
+    private:
+        struct StackEntry {
+            int node;
+            float t0, t1;
+        };
+
+        StackEntry* get_stack() const;
+        void draw_wireframe_node(Image& image, float4x4 const& transform, colorf const& color, int idx, Bound3f const& voxel) const;
+    };
+
+} // namespace tira
+
+#endif
@@ -0,0 +1,227 @@
+//
+// Created by Ziyi.Lu 2023/04/27
+//
+
+#include <algorithm>
+#include <scene/lazybvh.h>
+#include <misc/timer.h>
+
+namespace tira {
+
+    void LazyBVHAccel::build(std::vector<Object*>&& _objects) {
+        objects = std::move(_objects);
+        int n = objects.size();
+
+        Timer timer;
+
+        delete root;
+        root = new LazyBVHNode();
+        root->first_prim = 0;
+        root->prim_count = n;
+
+        Bound3f root_bound;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        {
+            Bound3f local_bound;
+#ifdef _OPENMP
+#pragma omp for nowait
+#endif
+            for (int i = 0; i < n; ++i) {
+                local_bound += objects[i]->get_bound();
+            }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            root_bound += local_bound;
+        }
+        root->bound = root_bound;
+        bound = root_bound;
+
+        timer.update();
+        std::cout << "[Tira] " << "Lazy BVH build time: " << timer.delta_time() << "s, nodes are split on first visit\n";
+    }
+
+    void LazyBVHAccel::expand(LazyBVHNode* node) {
+        std::call_once(node->expanded, [&]() { split(node); });
+    }
+
+    // Binned SAH split of the node, see BVHAccel::subdivide_binned.
+    void LazyBVHAccel::split(LazyBVHNode* node) {
+        if (node->prim_count <= max_objs) return;
+
+        auto first = objects.begin() + node->first_prim;
+        auto last = first + node->prim_count;
+
+        Bound3f center_bound;
+        for (auto it = first; it != last; ++it) center_bound += (*it)->get_center();
+        float3 center_extent = center_bound.get_extent();
+
+        auto get_bin = [&](Object const* object, int axis) {
+            float k = SAH_BINS / center_extent[axis];
+            int b = (object->get_center()[axis] - center_bound.min[axis]) * k;
+            return clamp(b, 0, SAH_BINS - 1);
+        };
+
+        int best_axis = -1;
+        int best_bin = 0;
+        float best_sah = std::numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (center_extent[axis] <= 0) continue;
+
+            Bound3f bin_bounds[SAH_BINS];
+            int bin_counts[SAH_BINS] = { 0 };
+            for (auto it = first; it != last; ++it) {
+                int b = get_bin(*it, axis);
+                bin_bounds[b] += (*it)->get_bound();
+                ++bin_counts[b];
+            }
+
+            float left_area[SAH_BINS - 1];
+            int left_count[SAH_BINS - 1];
+            Bound3f left_bound;
+            int count = 0;
+            for (int i = 0; i < SAH_BINS - 1; ++i) {
+                left_bound += bin_bounds[i];
+                count += bin_counts[i];
+                left_count[i] = count;
+                left_area[i] = count > 0 ? left_bound.get_surface_area() : 0.f;
+            }
+
+            Bound3f right_bound;
+            count = 0;
+            for (int i = SAH_BINS - 1; i > 0; --i) {
+                right_bound += bin_bounds[i];
+                count += bin_counts[i];
+                if (count == 0 || left_count[i - 1] == 0) continue;
+
+                float sah = left_area[i - 1] * left_count[i - 1] + right_bound.get_surface_area() * count;
+                if (sah < best_sah) {
+                    best_sah = sah;
+                    best_axis = axis;
+                    best_bin = i;
+                }
+            }
+        }
+
+        // All centers coincide otherwise, any partition is as good as another.
+        int left_count = node->prim_count / 2;
+        if (best_axis >= 0) {
+            auto middle = std::partition(first, last, [&](Object const* object) {
+                return get_bin(object, best_axis) < best_bin;
+            });
+            left_count = middle - first;
+        }
+
+        auto children = new LazyBVHNode[2];
+        children[0].first_prim = node->first_prim;
+        children[0].prim_count = left_count;
+        children[1].first_prim = node->first_prim + left_count;
+        children[1].prim_count = node->prim_count - left_count;
+        for (auto& c : { &children[0], &children[1] }) {
+            Bound3f b;
+            for (int i = 0; i < c->prim_count; ++i) b += objects[c->first_prim + i]->get_bound();
+            c->bound = b;
+        }
+        node->children.store(children, std::memory_order_release);
+    }
+
+    void LazyBVHAccel::intersect(Ray& ray, Intersection& isect) {
+        float t0, t1;
+        if (!root->bound.intersect(ray, t0, t1)) {
+            TRAVERSAL_STATS_RAY();
+            return;
+        }
+
+        thread_local std::vector<StackEntry> stack;
+        stack.clear();
+        stack.push_back({ root, t0 });
+
+        while (!stack.empty()) {
+            auto e = stack.back();
+            stack.pop_back();
+            if (beyond_closest_hit(e.t, isect)) continue;
+            TRAVERSAL_STATS_NODE();
+
+            auto node = e.node;
+            expand(node);
+            auto children = node->children.load(std::memory_order_acquire);
+            if (!children) {
+                for (int i = 0; i < node->prim_count; ++i) {
+                    TRAVERSAL_STATS_PRIM();
+                    objects[node->first_prim + i]->intersect(ray, isect);
+                }
+                continue;
+            }
+
+            // Push the farther child first so that the nearer one is popped first.
+            float t_near[2], t_far;
+            bool hit[2];
+            for (int i = 0; i < 2; ++i) {
+                hit[i] = children[i].bound.intersect(ray, t_near[i], t_far) && !beyond_closest_hit(t_near[i], isect);
+            }
+            int first = hit[0] && hit[1] && t_near[1] > t_near[0] ? 1 : 0;
+            for (int j = 0; j < 2; ++j) {
+                int i = first ^ j;
+                if (hit[i]) stack.push_back({ &children[i], t_near[i] });
+            }
+        }
+
+        TRAVERSAL_STATS_RAY();
+    }
+
+    bool LazyBVHAccel::occluded(Ray& ray, float t_max) {
+        float t0, t1;
+        if (!root->bound.intersect(ray, t0, t1) || t0 > t_max) {
+            TRAVERSAL_STATS_RAY();
+            return false;
+        }
+
+        thread_local std::vector<LazyBVHNode*> stack;
+        stack.clear();
+        stack.push_back(root);
+
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            TRAVERSAL_STATS_NODE();
+
+            expand(node);
+            auto children = node->children.load(std::memory_order_acquire);
+            if (!children) {
+                for (int i = 0; i < node->prim_count; ++i) {
+                    TRAVERSAL_STATS_PRIM();
+                    if (objects[node->first_prim + i]->occluded(ray, t_max)) {
+                        last_occluder = objects[node->first_prim + i];
+                        TRAVERSAL_STATS_RAY();
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            for (int i = 0; i < 2; ++i) {
+                if (children[i].bound.intersect(ray, t0, t1) && t0 <= t_max) stack.push_back(&children[i]);
+            }
+        }
+
+        TRAVERSAL_STATS_RAY();
+        return false;
+    }
+
+    void LazyBVHAccel::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
+        draw_wireframe_node(image, transform, color, root);
+    }
+
+    // Only draws the nodes expanded so far.
+    void LazyBVHAccel::draw_wireframe_node(Image& image, float4x4 const& transform, colorf const& color, LazyBVHNode const* node) const {
+        node->bound.draw_wireframe(image, transform, color);
+        auto children = node->children.load(std::memory_order_acquire);
+        if (children) {
+            draw_wireframe_node(image, transform, color, &children[0]);
+            draw_wireframe_node(image, transform, color, &children[1]);
+        }
+    }
+
+} // namespace tira
@@ -0,0 +1,64 @@
+//
+// Created by Ziyi.Lu 2023/04/27
+//
+
+#ifndef LAZYBVH_H
+#define LAZYBVH_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <scene/accel.h>
+#include <misc/utils.h>
+#include <misc/image.h>
+#include <geometry/object.h>
+
+namespace tira {
+
+    // Node of lazy BVH, children are created by the first ray that reaches the node.
+    struct LazyBVHNode {
+        Bound3f bound;
+        int first_prim = 0;
+        int prim_count = 0;
+        // Both children in one allocation, null for leaf. Only valid after expand.
+        std::atomic<LazyBVHNode*> children = nullptr;
+        std::once_flag expanded;
+
+        ~LazyBVHNode() { delete[] children.load(); }
+
+        bool is_leaf() const { return children.load(std::memory_order_acquire) == nullptr; }
+    };
+
+    /**
+     * BVH built on demand: build only bounds the objects, and a node is split with binned SAH
+     * the first time a ray reaches it, so rendering starts right away and regions no ray visits are never built.
+     * Concurrent rays reaching the same unexpanded node wait on its once_flag for one of them to split it.
+     * Splitting partitions the object range of the node in place, which no other node reads until the split is done.
+     */
+    struct LazyBVHAccel : Accelerator {
+        LazyBVHNode* root = nullptr;
+        int max_objs;
+
+        LazyBVHAccel(int _max_objs = 2)
+            : max_objs(_max_objs) {}
+        ~LazyBVHAccel() { delete root; }
+
+        virtual void build(std::vector<Object*>&& objects) override;
+        virtual void intersect(Ray& ray, Intersection& isect) override;
+        virtual bool occluded(Ray& ray, float t_max) override;
+        virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override;
+
+    private:
+        struct StackEntry {
+            LazyBVHNode* node;
+            float t;
+        };
+
+        void expand(LazyBVHNode* node);
+        void split(LazyBVHNode* node);
+        void draw_wireframe_node(Image& image, float4x4 const& transform, colorf const& color, LazyBVHNode const* node) const;
+    };
+
+} // namespace tira
+
+#endif
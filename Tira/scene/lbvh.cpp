@@ -0,0 +1,396 @@
+//
+// Created by Ziyi.Lu 2023/04/12
+//
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <numeric>
+#include <scene/bvh.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace tira {
+
+    /**
+     * Parallel BVH builders, both build an intermediate binary tree over single primitives:
+     *  - node [0, N) are leaves, leaf i holds the i-th primitive in Morton order.
+     *  - node [N, 2N - 1) are internal nodes.
+     * The tree is then flattened into BVHAccel::nodes, where subtrees with no more than
+     * max_objs primitives are collapsed into one leaf, so that traversal and GPU export
+     * see the same layout as the other split methods. Links are set up later by link_nodes.
+     */
+    struct BuildTree {
+        std::vector<Bound3f> bounds;
+        std::vector<int> left;
+        std::vector<int> right;
+        std::vector<int> count;
+        int root = 0;
+
+        BuildTree(int n)
+            : bounds(2 * n - 1)
+            , left(2 * n - 1, -1)
+            , right(2 * n - 1, -1)
+            , count(2 * n - 1, 1) {}
+    };
+
+    static int count_leading_zeros(uint32_t x) {
+        if (x == 0) return 32;
+#ifdef _MSC_VER
+        unsigned long idx;
+        _BitScanReverse(&idx, x);
+        return 31 - idx;
+#else
+        return __builtin_clz(x);
+#endif
+    }
+
+    // Insert two zero bits after each of the lower 10 bits.
+    static uint32_t expand_bits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    static uint32_t morton_code(float3 const& p) {
+        auto x = (uint32_t)clamp(p.x * 1024.f, 0.f, 1023.f);
+        auto y = (uint32_t)clamp(p.y * 1024.f, 0.f, 1023.f);
+        auto z = (uint32_t)clamp(p.z * 1024.f, 0.f, 1023.f);
+        return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+    }
+
+    // Parallel LSD radix sort of (key, value) pairs, 8 bits per pass.
+    static void radix_sort(std::vector<uint32_t>& keys, std::vector<int>& values) {
+        int n = keys.size();
+        std::vector<uint32_t> keys_tmp(n);
+        std::vector<int> values_tmp(n);
+        std::vector<std::array<int, 256>> histograms(get_max_threads());
+
+        for (int shift = 0; shift < 32; shift += 8) {
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+            {
+                int thread_num = get_num_threads();
+                int t = get_thread_num();
+                int begin = (int64_t)n * t / thread_num;
+                int end = (int64_t)n * (t + 1) / thread_num;
+
+                auto& hist = histograms[t];
+                hist.fill(0);
+                for (int i = begin; i < end; ++i) {
+                    ++hist[(keys[i] >> shift) & 0xFF];
+                }
+
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+                {
+                    // Exclusive prefix sum in (digit, thread) order keeps the sort stable.
+                    int offset = 0;
+                    for (int d = 0; d < 256; ++d) {
+                        for (int i = 0; i < thread_num; ++i) {
+                            int c = histograms[i][d];
+                            histograms[i][d] = offset;
+                            offset += c;
+                        }
+                    }
+                }
+
+                for (int i = begin; i < end; ++i) {
+                    int dst = hist[(keys[i] >> shift) & 0xFF]++;
+                    keys_tmp[dst] = keys[i];
+                    values_tmp[dst] = values[i];
+                }
+            }
+            keys.swap(keys_tmp);
+            values.swap(values_tmp);
+        }
+    }
+
+    /**
+     * Hierarchy generation as in: Tero Karras, Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees.
+     * Each internal node is computed independently from the sorted Morton codes.
+     */
+    static void build_karras(BuildTree& tree, std::vector<uint32_t> const& codes) {
+        int n = codes.size();
+
+        auto delta = [&](int i, int j) {
+            if (j < 0 || j >= n) return -1;
+            // Duplicated codes are disambiguated by their indices.
+            if (codes[i] == codes[j]) return 32 + count_leading_zeros((uint32_t)i ^ (uint32_t)j);
+            return count_leading_zeros(codes[i] ^ codes[j]);
+        };
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < n - 1; ++i) {
+            // Direction of the range covered by node i.
+            int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int delta_min = delta(i, i - d);
+
+            // Upper bound and then exact length of the range.
+            int l_max = 2;
+            while (delta(i, i + l_max * d) > delta_min) l_max *= 2;
+            int l = 0;
+            for (int t = l_max / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (l + t) * d) > delta_min) l += t;
+            }
+            int j = i + l * d;
+
+            // Binary search for the split position.
+            int delta_node = delta(i, j);
+            int s = 0;
+            int t = l;
+            do {
+                t = (t + 1) / 2;
+                if (delta(i, i + (s + t) * d) > delta_node) s += t;
+            } while (t > 1);
+            int gamma = i + s * d + std::min(d, 0);
+
+            tree.left[n + i] = std::min(i, j) == gamma ? gamma : n + gamma;
+            tree.right[n + i] = std::max(i, j) == gamma + 1 ? gamma + 1 : n + gamma + 1;
+        }
+        tree.root = n;
+
+        // Bottom-up bound computation, the second child to arrive at a node proceeds to its parent.
+        std::vector<int> parent(2 * n - 1, -1);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = n; i < 2 * n - 1; ++i) {
+            parent[tree.left[i]] = i;
+            parent[tree.right[i]] = i;
+        }
+
+        std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[n]);
+        for (int i = 0; i < n; ++i) visits[i] = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < n; ++i) {
+            int idx = parent[i];
+            while (idx >= 0) {
+                if (visits[idx - n].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+
+                int l = tree.left[idx];
+                int r = tree.right[idx];
+                Bound3f b = tree.bounds[l];
+                b += tree.bounds[r];
+                tree.bounds[idx] = b;
+                tree.count[idx] = tree.count[l] + tree.count[r];
+                idx = parent[idx];
+            }
+        }
+    }
+
+    /**
+     * Agglomerative clustering as in: Daniel Meister and Jiri Bittner, Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy Construction.
+     * Each cluster searches its nearest neighbor within PLOC_RADIUS clusters in Morton order,
+     * mutual nearest neighbors are merged, then the cluster list is compacted, until one cluster remains.
+     */
+    static void build_ploc(BuildTree& tree, int n) {
+        std::vector<int> clusters(n);
+        std::iota(clusters.begin(), clusters.end(), 0);
+        std::vector<int> clusters_next(n);
+        std::vector<int> neighbors(n);
+        std::vector<int> merged(n + 1);
+        int next_node = n;
+
+        auto merged_area = [&](int a, int b) {
+            Bound3f bound = tree.bounds[a];
+            bound += tree.bounds[b];
+            return bound.get_surface_area();
+        };
+
+        while (clusters.size() > 1) {
+            int m = clusters.size();
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+            for (int i = 0; i < m; ++i) {
+                int best = -1;
+                float best_area = FLOAT_MAX;
+                int begin = std::max(0, i - PLOC_RADIUS);
+                int end = std::min(m - 1, i + PLOC_RADIUS);
+                for (int j = begin; j <= end; ++j) {
+                    if (j == i) continue;
+                    float area = merged_area(clusters[i], clusters[j]);
+                    // Ties are resolved toward lower indices so that nearest neighbors stay mutual.
+                    if (area < best_area) {
+                        best_area = area;
+                        best = j;
+                    }
+                }
+                neighbors[i] = best;
+            }
+
+            // Mark the lower cluster of every mutual pair, then number the new nodes with a prefix sum.
+            merged[0] = 0;
+            for (int i = 0; i < m; ++i) {
+                bool first = neighbors[neighbors[i]] == i && i < neighbors[i];
+                merged[i + 1] = merged[i] + (first ? 1 : 0);
+            }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+            for (int i = 0; i < m; ++i) {
+                int j = neighbors[i];
+                if (neighbors[j] != i) {
+                    clusters_next[i] = clusters[i];
+                }
+                else if (i < j) {
+                    int idx = next_node + merged[i];
+                    int l = clusters[i];
+                    int r = clusters[j];
+                    tree.left[idx] = l;
+                    tree.right[idx] = r;
+                    tree.bounds[idx] = tree.bounds[l];
+                    tree.bounds[idx] += tree.bounds[r];
+                    tree.count[idx] = tree.count[l] + tree.count[r];
+                    clusters_next[i] = idx;
+                }
+                else {
+                    clusters_next[i] = -1;
+                }
+            }
+            next_node += merged[m];
+
+            int k = 0;
+            for (int i = 0; i < m; ++i) {
+                if (clusters_next[i] >= 0) clusters[k++] = clusters_next[i];
+            }
+            clusters.resize(k);
+        }
+        tree.root = clusters[0];
+    }
+
+    void BVHAccel::build_parallel() {
+        int n = objects.size();
+        nodes.clear();
+        nodes.reserve(std::max(2 * n - 1, 1));
+
+        BVHNode root;
+        root.left = root.right = 0;
+        root.first_prim = 0;
+        root.prim_count = n;
+        root.height = 0;
+        nodes.push_back(root);
+        update_node_bound(0);
+
+        if (n <= max_objs) return;
+
+        // Morton codes of object centers, normalized in the bound of centers.
+        Bound3f center_bound;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        {
+            Bound3f local_bound;
+#ifdef _OPENMP
+#pragma omp for nowait
+#endif
+            for (int i = 0; i < n; ++i) {
+                local_bound += objects[i]->get_center();
+            }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            center_bound += local_bound;
+        }
+
+        float3 extent = center_bound.get_extent();
+        float3 inv_extent;
+        for (int i = 0; i < 3; ++i) {
+            inv_extent[i] = extent[i] > 0 ? 1.f / extent[i] : 0.f;
+        }
+
+        std::vector<uint32_t> codes(n);
+        std::vector<int> order(n);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < n; ++i) {
+            codes[i] = morton_code((objects[i]->get_center() - center_bound.min) * inv_extent);
+            order[i] = i;
+        }
+
+        radix_sort(codes, order);
+
+        BuildTree tree(n);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < n; ++i) {
+            tree.bounds[i] = objects[order[i]]->get_bound();
+        }
+
+        if (split_method == SplitMethod::PLOC)
+            build_ploc(tree, n);
+        else
+            build_karras(tree, codes);
+
+        // Flatten into nodes in the same layout as subdivide, objects are reordered so that each leaf is a contiguous range.
+        std::vector<Object*> sorted_objects;
+        sorted_objects.reserve(n);
+        std::vector<std::pair<int, int>> stack = { { tree.root, 0 } };
+        std::vector<int> leaf_stack;
+
+        while (!stack.empty()) {
+            auto [t, idx] = stack.back();
+            stack.pop_back();
+
+            if (nodes[idx].height > max_height) max_height = nodes[idx].height;
+
+            if (tree.count[t] <= max_objs || tree.left[t] < 0) {
+                auto& node = nodes[idx];
+                node.first_prim = sorted_objects.size();
+                node.prim_count = tree.count[t];
+
+                leaf_stack.push_back(t);
+                while (!leaf_stack.empty()) {
+                    int l = leaf_stack.back();
+                    leaf_stack.pop_back();
+                    if (tree.left[l] < 0) {
+                        sorted_objects.push_back(objects[order[l]]);
+                    }
+                    else {
+                        leaf_stack.push_back(tree.right[l]);
+                        leaf_stack.push_back(tree.left[l]);
+                    }
+                }
+                continue;
+            }
+
+            BVHNode left;
+            left.bound = tree.bounds[tree.left[t]];
+            left.left = left.right = 0;
+            left.height = nodes[idx].height + 1;
+
+            BVHNode right = left;
+            right.bound = tree.bounds[tree.right[t]];
+
+            auto& node = nodes[idx];
+            node.left = nodes.size();
+            nodes.push_back(left);
+            node.right = nodes.size();
+            nodes.push_back(right);
+            node.prim_count = 0;
+
+            stack.push_back({ tree.right[t], node.right });
+            stack.push_back({ tree.left[t], node.left });
+        }
+
+        objects = std::move(sorted_objects);
+    }
+
+} // namespace tira
@@ -8,34 +8,6 @@
 
 namespace tira {
 
-    using CompareNode = std::pair<OctreeNode*, float>;
-
-    void OctreeNode::intersect(Ray& ray, Intersection& isect) const {
-        if (bound.intersect(ray) == FLOAT_MAX) return;
-
-        if (!is_leaf()) {
-            std::vector<CompareNode> nodes;
-
-            for (auto c : children) {
-                nodes.push_back({ c, c->bound.distant_to(ray.origin) });
-            }
-
-            std::sort(nodes.begin(), nodes.end(), [](CompareNode lhs, CompareNode rhs) {
-                return lhs.second < rhs.second;
-                });
-
-            for (auto n : nodes) {
-                n.first->intersect(ray, isect);
-
-                if (isect.hit) break;
-            }
-        }
-
-        for (auto& o : objects) {
-            o->intersect(ray, isect);
-        }
-    }
-
     void OctreeNode::insert(Object* object, int max_objs) {
         if (objects.size() < max_objs) {
             objects.push_back(object);
@@ -64,6 +36,12 @@ namespace tira {
         }
     }
 
+    int OctreeNode::get_depth() const {
+        int depth = 0;
+        if (!is_leaf()) for (auto c : children) depth = std::max(depth, c->get_depth());
+        return depth + 1;
+    }
+
     void OctreeNode::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
         bound.draw_wireframe(image, transform, color);
 
@@ -104,20 +82,116 @@ namespace tira {
     void OctreeAccel::build(std::vector<Object*>&& _objects) {
         objects = std::move(_objects);
 
-        auto bound = Bound3f();
+        bound = Bound3f();
         for (auto& o : objects) {
             bound += o->get_bound();
         }
 
+        delete root;
         root = new OctreeNode(bound);
 
         for (auto& o : objects) {
             root->insert(o, max_objs);
         }
+
+        // Every visited node replaces itself with at most 4 children.
+        stack_size = root->get_depth() * 3 + 1;
+    }
+
+    typename OctreeAccel::StackEntry* OctreeAccel::get_stack() const {
+        thread_local std::vector<StackEntry> stack;
+        if ((int)stack.size() < stack_size) stack.resize(stack_size);
+        return stack.data();
+    }
+
+    /**
+     * Pushes the children of e.node the ray passes through, nearest on top.
+     * The ray starts in the octant containing its entry point and moves to the neighbor octant
+     * each time it crosses a mid-plane, which happens at most 3 times inside the node.
+     */
+    int OctreeAccel::push_children(StackEntry const& e, Ray const& ray, StackEntry* stack, int ptr) const {
+        auto center = e.node->bound.get_center();
+        float t_mid[3];
+        int child = 0;
+        for (int a = 0; a < 3; ++a) {
+            t_mid[a] = (center[a] - ray.origin[a]) * ray.inv_dir[a];
+            bool upper = ray.direction[a] == 0 ? ray.origin[a] > center[a] : (ray.direction[a] > 0) == (e.t0 >= t_mid[a]);
+            if (upper) child |= 4 >> a;
+        }
+
+        StackEntry entries[4];
+        int count = 0;
+        float t = e.t0;
+        while (true) {
+            float t_next = e.t1;
+            for (int a = 0; a < 3; ++a) {
+                if (t_mid[a] > t && t_mid[a] < t_next) t_next = t_mid[a];
+            }
+            entries[count++] = { e.node->children[child], t, t_next };
+            if (t_next >= e.t1) break;
+            for (int a = 0; a < 3; ++a) {
+                if (t_mid[a] == t_next) child ^= 4 >> a;
+            }
+            t = t_next;
+        }
+
+        while (count > 0) stack[ptr++] = entries[--count];
+        return ptr;
     }
 
     void OctreeAccel::intersect(Ray& ray, Intersection& isect) {
-        root->intersect(ray, isect);
+        float t0, t1;
+        if (!bound.intersect(ray, t0, t1)) {
+            TRAVERSAL_STATS_RAY();
+            return;
+        }
+
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { root, t0, t1 };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+            if (beyond_closest_hit(e.t0, isect)) continue;
+            TRAVERSAL_STATS_NODE();
+
+            for (auto& o : e.node->objects) {
+                TRAVERSAL_STATS_PRIM();
+                o->intersect(ray, isect);
+            }
+            if (!e.node->is_leaf()) ptr = push_children(e, ray, stack, ptr);
+        }
+        TRAVERSAL_STATS_RAY();
+    }
+
+    bool OctreeAccel::occluded(Ray& ray, float t_max) {
+        float t0, t1;
+        if (!bound.intersect(ray, t0, t1) || t0 > t_max) {
+            TRAVERSAL_STATS_RAY();
+            return false;
+        }
+
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { root, t0, t1 };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+            if (e.t0 > t_max) continue;
+            TRAVERSAL_STATS_NODE();
+
+            for (auto& o : e.node->objects) {
+                TRAVERSAL_STATS_PRIM();
+                if (o->occluded(ray, t_max)) {
+                    last_occluder = o;
+                    TRAVERSAL_STATS_RAY();
+                    return true;
+                }
+            }
+            if (!e.node->is_leaf()) ptr = push_children(e, ray, stack, ptr);
+        }
+        TRAVERSAL_STATS_RAY();
+        return false;
     }
 
     void OctreeAccel::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
@@ -16,26 +16,31 @@ namespace tira {
     struct OctreeNode {
         Bound3f bound;
         std::vector<Object*> objects;
-        mutable OctreeNode* children[8] = { nullptr };
-        float dist; // When traverse child nodes, record dist to ray origin.
+        OctreeNode* children[8] = { nullptr };
 
         OctreeNode() = delete;
         OctreeNode(Bound3f const& _bound) : bound(_bound) {}
 
         ~OctreeNode() { for (auto c : children) delete c; }
 
-        void intersect(Ray& ray, Intersection& isect) const;
         bool is_leaf() const { return children[0] == nullptr; }
         void insert(Object* object, int max_objs = 4);
+        int get_depth() const;
         void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const;
 
     private:
         int get_child_containing_object(Object* object) const;
     };
 
+    /**
+     * Objects are kept in the deepest node containing them, so internal nodes may hold objects too.
+     * Traversal is iterative and visits the children a ray passes through front-to-back,
+     * in the order it crosses the mid-planes of a node.
+     */
     struct OctreeAccel : Accelerator {
-        OctreeNode* root;
+        OctreeNode* root = nullptr;
         int max_objs;
+        int stack_size = 0;
 
         OctreeAccel(int _max_objs = 4)
             : max_objs(_max_objs) {}
@@ -43,11 +48,21 @@ namespace tira {
         OctreeAccel(const OctreeAccel&) = delete;
         OctreeAccel(OctreeAccel&&) = delete;
 
-        virtual ~OctreeAccel() {}
+        virtual ~OctreeAccel() { delete root; }
 
         virtual void build(std::vector<Object*>&& objects) override;
         virtual void intersect(Ray& ray, Intersection& isect) override;
+        virtual bool occluded(Ray& ray, float t_max) override;
         virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override;
+
+    private:
+        struct StackEntry {
+            OctreeNode const* node;
+            float t0, t1;
+        };
+
+        StackEntry* get_stack() const;
+        int push_children(StackEntry const& e, Ray const& ray, StackEntry* stack, int ptr) const;
     };
 
 } // namespace tira
@@ -0,0 +1,375 @@
+//
+// Created by Ziyi.Lu 2023/04/12
+//
+
+#include <algorithm>
+#include <scene/bvh.h>
+
+namespace tira {
+
+    /**
+     * Spatial split BVH as in: Martin Stich et al., Spatial Splits in Bounding Volume Hierarchies.
+     * A reference is the part of an object inside a bound. Every node evaluates the binned object split,
+     * and when the children of that split overlap by more than SBVH_ALPHA of the root area, also a binned
+     * spatial split that clips the references straddling the plane into both children.
+     * An object may end up in several leaves, leaves then index BVHAccel::references rather than objects.
+     * Testing the same object twice yields the same hit, so closest hit and occlusion need no extra work.
+     */
+    struct SpatialReference {
+        Bound3f bound;
+        Object* object;
+        // Triangles are clipped exactly, other objects only by their bound.
+        Triangle const* triangle;
+    };
+
+    struct SpatialBuilder {
+        std::vector<BVHNode>& nodes;
+        std::vector<Object*>& references;
+        int max_objs;
+        int max_height = 0;
+        float min_overlap = 0.f;
+        int max_references = 0;
+        // References in the finished tree, grows with every spatial split.
+        int reference_count = 0;
+        int spatial_splits = 0;
+
+        void subdivide(int idx, std::vector<SpatialReference>& refs);
+    };
+
+    static Bound3f overlap(Bound3f const& a, Bound3f const& b) {
+        return Bound3f(float3::max(a.min, b.min), float3::min(a.max, b.max));
+    }
+
+    // Clipping may leave nothing on one side of a plane, the bound is then inverted.
+    static bool is_valid(Bound3f const& b) {
+        auto extent = b.get_extent();
+        return extent.x >= 0 && extent.y >= 0 && extent.z >= 0;
+    }
+
+    static float area_of(Bound3f const& b) {
+        return is_valid(b) ? b.get_surface_area() : 0.f;
+    }
+
+    // Bounds of the parts of ref on both sides of the plane at pos along axis.
+    static void split_reference(SpatialReference const& ref, int axis, float pos, Bound3f& left, Bound3f& right) {
+        left = right = Bound3f();
+        if (ref.triangle) {
+            for (int i = 0; i < 3; ++i) {
+                float3 const& v0 = ref.triangle->pos[i];
+                float3 const& v1 = ref.triangle->pos[(i + 1) % 3];
+                float p0 = v0[axis];
+                float p1 = v1[axis];
+                if (p0 <= pos) left += v0;
+                if (p0 >= pos) right += v0;
+                if ((p0 < pos && pos < p1) || (p1 < pos && pos < p0)) {
+                    float3 p = v0 + (v1 - v0) * clamp((pos - p0) / (p1 - p0), 0.f, 1.f);
+                    p[axis] = pos;
+                    left += p;
+                    right += p;
+                }
+            }
+        }
+        else {
+            left = right = ref.bound;
+        }
+        left.max[axis] = std::min(left.max[axis], pos);
+        right.min[axis] = std::max(right.min[axis], pos);
+        left = overlap(left, ref.bound);
+        right = overlap(right, ref.bound);
+    }
+
+    void SpatialBuilder::subdivide(int idx, std::vector<SpatialReference>& refs) {
+        int n = refs.size();
+        int height = nodes[idx].height;
+        if (height > max_height) max_height = height;
+
+        if (n <= max_objs) {
+            auto& node = nodes[idx];
+            node.first_prim = references.size();
+            node.prim_count = n;
+            for (auto const& ref : refs) references.push_back(ref.object);
+            return;
+        }
+
+        struct Bin {
+            Bound3f bound;
+            int count = 0;
+            int exit = 0;
+        };
+
+        Bound3f node_bound = nodes[idx].bound;
+
+        // Binned object split over the centers of references, same as BVHAccel::subdivide_binned.
+        Bound3f center_bound;
+        for (auto const& ref : refs) center_bound += ref.bound.get_center();
+        float3 center_extent = center_bound.get_extent();
+
+        auto get_bin = [&](SpatialReference const& ref, int axis) {
+            float k = SAH_BINS / center_extent[axis];
+            int b = (ref.bound.get_center()[axis] - center_bound.min[axis]) * k;
+            return clamp(b, 0, SAH_BINS - 1);
+        };
+
+        int object_axis = -1;
+        int object_bin = 0;
+        float object_sah = std::numeric_limits<float>::max();
+        Bound3f object_left, object_right;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (center_extent[axis] <= 0) continue;
+
+            Bin bins[SAH_BINS];
+            for (auto const& ref : refs) {
+                auto& bin = bins[get_bin(ref, axis)];
+                bin.bound += ref.bound;
+                ++bin.count;
+            }
+
+            Bound3f left_bounds[SAH_BINS - 1];
+            int left_count[SAH_BINS - 1];
+            Bound3f left_bound;
+            int count = 0;
+            for (int i = 0; i < SAH_BINS - 1; ++i) {
+                left_bound += bins[i].bound;
+                count += bins[i].count;
+                left_count[i] = count;
+                left_bounds[i] = left_bound;
+            }
+
+            Bound3f right_bound;
+            count = 0;
+            for (int i = SAH_BINS - 1; i > 0; --i) {
+                right_bound += bins[i].bound;
+                count += bins[i].count;
+                if (count == 0 || left_count[i - 1] == 0) continue;
+
+                float sah = left_bounds[i - 1].get_surface_area() * left_count[i - 1] + right_bound.get_surface_area() * count;
+                if (sah < object_sah) {
+                    object_sah = sah;
+                    object_axis = axis;
+                    object_bin = i;
+                    object_left = left_bounds[i - 1];
+                    object_right = right_bound;
+                }
+            }
+        }
+
+        // Binned spatial split, only tried where the object split leaves overlapping children.
+        int spatial_axis = -1;
+        float spatial_pos = 0.f;
+        float spatial_sah = std::numeric_limits<float>::max();
+        int spatial_left_count = 0;
+        int spatial_right_count = 0;
+
+        bool try_spatial = reference_count < max_references
+            && (object_axis < 0 || area_of(overlap(object_left, object_right)) > min_overlap);
+
+        if (try_spatial) {
+            float3 extent = node_bound.get_extent();
+            for (int axis = 0; axis < 3; ++axis) {
+                if (extent[axis] <= 0) continue;
+
+                float bin_size = extent[axis] / SAH_BINS;
+                auto get_spatial_bin = [&](float p) {
+                    return clamp(int((p - node_bound.min[axis]) / bin_size), 0, SAH_BINS - 1);
+                };
+
+                Bin bins[SAH_BINS];
+                for (auto const& ref : refs) {
+                    int first = get_spatial_bin(ref.bound.min[axis]);
+                    int last = get_spatial_bin(ref.bound.max[axis]);
+                    ++bins[first].count;
+                    ++bins[last].exit;
+
+                    // Chop the reference at every bin plane it straddles.
+                    SpatialReference rest = ref;
+                    for (int b = first; b < last && is_valid(rest.bound); ++b) {
+                        Bound3f left;
+                        split_reference(rest, axis, node_bound.min[axis] + bin_size * (b + 1), left, rest.bound);
+                        if (is_valid(left)) bins[b].bound += left;
+                    }
+                    if (is_valid(rest.bound)) bins[last].bound += rest.bound;
+                }
+
+                float left_area[SAH_BINS - 1];
+                int left_count[SAH_BINS - 1];
+                Bound3f left_bound;
+                int count = 0;
+                for (int i = 0; i < SAH_BINS - 1; ++i) {
+                    left_bound += bins[i].bound;
+                    count += bins[i].count;
+                    left_count[i] = count;
+                    left_area[i] = area_of(left_bound);
+                }
+
+                Bound3f right_bound;
+                count = 0;
+                for (int i = SAH_BINS - 1; i > 0; --i) {
+                    right_bound += bins[i].bound;
+                    count += bins[i].exit;
+                    // Each side must shrink, otherwise the split never terminates.
+                    if (count == 0 || left_count[i - 1] == 0 || count == n || left_count[i - 1] == n) continue;
+
+                    float sah = left_area[i - 1] * left_count[i - 1] + area_of(right_bound) * count;
+                    if (sah < spatial_sah) {
+                        spatial_sah = sah;
+                        spatial_axis = axis;
+                        spatial_pos = node_bound.min[axis] + bin_size * i;
+                        spatial_left_count = left_count[i - 1];
+                        spatial_right_count = count;
+                    }
+                }
+            }
+        }
+
+        std::vector<SpatialReference> left_refs;
+        std::vector<SpatialReference> right_refs;
+
+        bool use_spatial = spatial_axis >= 0 && spatial_sah < object_sah
+            && reference_count + spatial_left_count + spatial_right_count - n <= max_references;
+
+        if (use_spatial) {
+            int axis = spatial_axis;
+            Bound3f left_bound, right_bound;
+            std::vector<SpatialReference const*> straddling;
+            for (auto const& ref : refs) {
+                if (ref.bound.max[axis] <= spatial_pos) {
+                    left_refs.push_back(ref);
+                    left_bound += ref.bound;
+                }
+                else if (ref.bound.min[axis] >= spatial_pos) {
+                    right_refs.push_back(ref);
+                    right_bound += ref.bound;
+                }
+                else {
+                    straddling.push_back(&ref);
+                }
+            }
+
+            // Reference unsplitting: keep a straddling reference whole on one side when that is cheaper.
+            for (auto ref : straddling) {
+                int nl = left_refs.size();
+                int nr = right_refs.size();
+                Bound3f left, right;
+                split_reference(*ref, axis, spatial_pos, left, right);
+
+                // Nothing of the object lies on one side of the plane inside the reference bound.
+                if (!is_valid(left) || !is_valid(right)) {
+                    auto r = *ref;
+                    if (is_valid(left)) r.bound = left;
+                    else if (is_valid(right)) r.bound = right;
+                    bool to_left = is_valid(left) || !is_valid(right);
+                    (to_left ? left_refs : right_refs).push_back(r);
+                    (to_left ? left_bound : right_bound) += r.bound;
+                    continue;
+                }
+
+                Bound3f split_left = left_bound; split_left += left;
+                Bound3f split_right = right_bound; split_right += right;
+                Bound3f whole_left = left_bound; whole_left += ref->bound;
+                Bound3f whole_right = right_bound; whole_right += ref->bound;
+
+                float split_cost = area_of(split_left) * (nl + 1) + area_of(split_right) * (nr + 1);
+                float left_cost = area_of(whole_left) * (nl + 1) + area_of(right_bound) * nr;
+                float right_cost = area_of(left_bound) * nl + area_of(whole_right) * (nr + 1);
+
+                if (left_cost < split_cost && left_cost <= right_cost) {
+                    left_refs.push_back(*ref);
+                    left_bound = whole_left;
+                }
+                else if (right_cost < split_cost) {
+                    right_refs.push_back(*ref);
+                    right_bound = whole_right;
+                }
+                else {
+                    auto l = *ref;
+                    auto r = *ref;
+                    l.bound = left;
+                    r.bound = right;
+                    left_refs.push_back(l);
+                    right_refs.push_back(r);
+                    left_bound = split_left;
+                    right_bound = split_right;
+                }
+            }
+
+            if (left_refs.empty() || right_refs.empty() || (int)left_refs.size() == n || (int)right_refs.size() == n) {
+                use_spatial = false;
+                left_refs.clear();
+                right_refs.clear();
+            }
+            else {
+                reference_count += left_refs.size() + right_refs.size() - n;
+                ++spatial_splits;
+            }
+        }
+
+        if (!use_spatial) {
+            // Without an object split all centers coincide and any partition is as good as another.
+            for (auto const& ref : refs) {
+                bool left = object_axis >= 0 ? get_bin(ref, object_axis) < object_bin : (int)left_refs.size() < n / 2;
+                (left ? left_refs : right_refs).push_back(ref);
+            }
+        }
+
+        std::vector<SpatialReference>().swap(refs);
+
+        BVHNode left;
+        left.left = left.right = 0;
+        left.first_prim = left.prim_count = 0;
+        left.height = height + 1;
+        for (auto const& ref : left_refs) left.bound += ref.bound;
+
+        BVHNode right = left;
+        right.bound = Bound3f();
+        for (auto const& ref : right_refs) right.bound += ref.bound;
+
+        int left_idx = nodes.size();
+        nodes.push_back(left);
+        int right_idx = nodes.size();
+        nodes.push_back(right);
+        nodes[idx].left = left_idx;
+        nodes[idx].right = right_idx;
+        nodes[idx].prim_count = 0;
+
+        subdivide(left_idx, left_refs);
+        subdivide(right_idx, right_refs);
+    }
+
+    void BVHAccel::build_spatial() {
+        int n = objects.size();
+        nodes.clear();
+        references.clear();
+
+        std::vector<SpatialReference> refs(n);
+        Bound3f root_bound;
+        for (int i = 0; i < n; ++i) {
+            refs[i].object = objects[i];
+            refs[i].triangle = dynamic_cast<Triangle const*>(objects[i]);
+            refs[i].bound = objects[i]->get_bound();
+            root_bound += refs[i].bound;
+        }
+
+        BVHNode root;
+        root.bound = root_bound;
+        root.left = root.right = 0;
+        root.first_prim = 0;
+        root.prim_count = n;
+        root.height = 0;
+        nodes.push_back(root);
+
+        SpatialBuilder builder{ nodes, references, max_objs };
+        builder.min_overlap = root_bound.get_surface_area() * SBVH_ALPHA;
+        builder.max_references = n + int(n * SBVH_DUPLICATION_BUDGET);
+        builder.reference_count = n;
+        references.reserve(builder.max_references);
+        builder.subdivide(0, refs);
+        max_height = builder.max_height;
+
+        std::cout << "[Tira] " << "SBVH spatial splits: " << builder.spatial_splits
+            << ", references: " << references.size() << " (+" << (n > 0 ? 100.f * (references.size() - n) / n : 0.f)
+            << "% over " << n << " objects), memory: " << (nodes.size() * sizeof(BVHNode) + references.size() * sizeof(Object*)) / 1024
+            << " KB\n";
+    }
+
+} // namespace tira
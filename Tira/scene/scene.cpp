@@ -10,10 +10,15 @@
 #include <geometry/sphere.h>
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <scene/bvh.h>
+#include <scene/wbvh.h>
 #include <scene/octree.h>
+#include <scene/kdtree.h>
+#include <scene/grid.h>
+#include <scene/cbvh.h>
+#include <scene/lazybvh.h>
+#include <scene/instance.h>
 #include <thirdparty/tiny_obj_loader.h>
 #include <thirdparty/pugixml.hpp>
-#include <thirdparty/PoissonGenerator.h>
 
 namespace tira {
 
@@ -35,7 +40,33 @@ namespace tira {
     void Scene::intersect(Ray& ray, Intersection& isect) const {
         if (accel) {
             accel->intersect(ray, isect);
+            if (isect.hit && !ray.shadow_ray) {
+                auto object = isect.instance ? isect.instance : isect.object;
+                object->compute_surface_interaction(ray, isect);
+            }
+        }
+    }
+
+    void Scene::intersect_packet(Ray* rays, Intersection* isects, int n) const {
+        if (accel) {
+            accel->intersect_packet(rays, isects, n);
+            for (int i = 0; i < n; ++i) {
+                if (isects[i].hit && !rays[i].shadow_ray) {
+                    auto object = isects[i].instance ? isects[i].instance : isects[i].object;
+                    object->compute_surface_interaction(rays[i], isects[i]);
+                }
+            }
+        }
+    }
+
+    bool Scene::occluded(Ray& ray, float t_max, int light) const {
+        if (accel) {
+#ifdef ENABLE_SHADOW_CACHE
+            if (light >= 0) return shadow_cache.occluded(accel, ray, t_max, light);
+#endif
+            return accel->occluded(ray, t_max);
         }
+        return false;
     }
 
     void Scene::load_envmap(std::string const& path) {
@@ -90,8 +121,48 @@ namespace tira {
             if (type == std::string("bvh")) {
                 accel_type = AcceleratorType::BVH;
             }
+            else if (type == std::string("bvh4")) {
+                accel_type = AcceleratorType::BVH4;
+            }
+            else if (type == std::string("bvh8")) {
+                accel_type = AcceleratorType::BVH8;
+            }
             else if (type == std::string("octree")) {
-                accel_type = AcceleratorType::BVH;
+                accel_type = AcceleratorType::Octree;
+            }
+            else if (type == std::string("kdtree")) {
+                accel_type = AcceleratorType::KdTree;
+            }
+            else if (type == std::string("grid")) {
+                accel_type = AcceleratorType::Grid;
+            }
+            else if (type == std::string("cbvh8")) {
+                accel_type = AcceleratorType::CBVH8;
+            }
+            else if (type == std::string("cbvh16")) {
+                accel_type = AcceleratorType::CBVH16;
+            }
+            else if (type == std::string("lazybvh")) {
+                accel_type = AcceleratorType::LazyBVH;
+            }
+            if (!node.attribute("split").empty()) {
+                auto const& split = node.attribute("split").as_string();
+                if (split == std::string("naive")) accel_info.split_method = BVHAccel::SplitMethod::NAIVE;
+                if (split == std::string("sah")) accel_info.split_method = BVHAccel::SplitMethod::SAH;
+                if (split == std::string("binned")) accel_info.split_method = BVHAccel::SplitMethod::BINNED;
+                if (split == std::string("lbvh")) accel_info.split_method = BVHAccel::SplitMethod::LBVH;
+                if (split == std::string("ploc")) accel_info.split_method = BVHAccel::SplitMethod::PLOC;
+                if (split == std::string("sbvh")) accel_info.split_method = BVHAccel::SplitMethod::SBVH;
+            }
+            if (!node.attribute("traversal").empty()) {
+                auto const& traversal = node.attribute("traversal").as_string();
+                if (traversal == std::string("recursive")) accel_info.traversal_method = BVHAccel::TraversalMethod::RECURSIVE;
+                if (traversal == std::string("stackless")) accel_info.traversal_method = BVHAccel::TraversalMethod::STACKLESS;
+                if (traversal == std::string("stack")) accel_info.traversal_method = BVHAccel::TraversalMethod::STACK;
+                if (traversal == std::string("ordered")) accel_info.traversal_method = BVHAccel::TraversalMethod::STACKLESS_ORDERED;
+            }
+            if (!node.attribute("optimize").empty()) {
+                accel_info.optimize = node.attribute("optimize").as_bool();
             }
         }
 
@@ -186,8 +257,17 @@ namespace tira {
 
         std::vector<Object*> objects;
 
+        // Shapes placed by instances are built once into shared meshes instead of being flattened into the scene.
+        std::unordered_map<std::string, std::vector<Object*>> instanced_shapes;
+        for (auto& node : doc.children("instance")) {
+            REQUIRED_ATTRIBUTE(node, "shape");
+            instanced_shapes[node.attribute("shape").as_string()];
+        }
+
         timer.update();
         for (size_t s = 0; s < shapes.size(); s++) {
+            auto instanced = instanced_shapes.find(shapes[s].name);
+            auto& shape_objects = instanced != instanced_shapes.end() ? instanced->second : objects;
             size_t index_offset = 0;
             for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
                 size_t fv = size_t(shapes[s].mesh.num_face_vertices[f]);
@@ -216,10 +296,6 @@ namespace tira {
                     }
                 }
 
-                triangle->e01 = triangle->pos[1] - triangle->pos[0];
-                triangle->e02 = triangle->pos[2] - triangle->pos[0];
-                triangle->normal = triangle->e01.cross(triangle->e02).normalized();
-
                 index_offset += fv;
 
                 auto material_id = shapes[s].mesh.material_ids[f];
@@ -228,12 +304,9 @@ namespace tira {
                 }
                 triangle->material = materials[material_id];
 
-                triangle->calc_center();
-                triangle->calc_bound();
-                triangle->calc_area();
-                triangle->calc_tangent();
+                triangle->update_geometry();
 
-                objects.push_back((Object*)triangle);
+                shape_objects.push_back((Object*)triangle);
             }
         }
 
@@ -260,6 +333,52 @@ namespace tira {
             objects.push_back((Object*)s);
         }
 
+        std::unordered_map<std::string, std::shared_ptr<BVHAccel>> meshes;
+        for (auto& [name, shape_objects] : instanced_shapes) {
+            if (shape_objects.empty()) {
+                std::cout << "[Tira] " << "Instanced shape not found: " << name << "\n";
+                continue;
+            }
+            auto mesh = std::make_shared<BVHAccel>(2, accel_info.split_method);
+            mesh->traversal_method = accel_info.traversal_method;
+            mesh->optimize = accel_info.optimize;
+            mesh->build(std::move(shape_objects));
+            meshes[name] = mesh;
+        }
+
+        int instance_count = 0;
+        for (auto& node : doc.children("instance")) {
+            auto mesh = meshes.find(node.attribute("shape").as_string());
+            if (mesh == meshes.end()) continue;
+
+            // Scale, then rotate around axis by angle in degrees, then translate.
+            float3 translate = { 0.f };
+            float4 rotate = { 0.f, 1.f, 0.f, 0.f };
+            float3 scale = { 1.f };
+            if (!node.attribute("translate").empty()) {
+                CHECK_SCANNED_ITEMS(sscanf(node.attribute("translate").as_string(), "%f,%f,%f", &translate.x, &translate.y, &translate.z), 3);
+            }
+            if (!node.attribute("rotate").empty()) {
+                CHECK_SCANNED_ITEMS(sscanf(node.attribute("rotate").as_string(), "%f,%f,%f,%f", &rotate.x, &rotate.y, &rotate.z, &rotate.w), 4);
+            }
+            if (!node.attribute("scale").empty()) {
+                if (sscanf(node.attribute("scale").as_string(), "%f,%f,%f", &scale.x, &scale.y, &scale.z) == 1) {
+                    scale.y = scale.z = scale.x;
+                }
+            }
+
+            auto R = transform::rotate(normalize(float3(rotate)), deg2rad(rotate.w));
+            float3x3 linear = float3x3(float3(R[0]), float3(R[1]), float3(R[2])) * float3x3(
+                scale.x, 0.f, 0.f,
+                0.f, scale.y, 0.f,
+                0.f, 0.f, scale.z);
+            objects.push_back((Object*)new Instance(mesh->second, linear, translate * scene_scale));
+            ++instance_count;
+        }
+        if (instance_count > 0) {
+            std::cout << "[Tira] " << "Instances: " << instance_count << " of " << meshes.size() << " meshes\n";
+        }
+
         std::cout << "[Tira] " << "Materials load: " << materials.size() << "\n";
         std::cout << "[Tira] " << "Objects load: " << objects.size() << "\n";
 
@@ -333,6 +452,15 @@ namespace tira {
             }
         }
 
+        // Lights are sampled in world space from accel objects, which instanced meshes are not part of.
+        for (auto& [name, mesh] : meshes) {
+            for (auto& o : mesh->objects) {
+                if (o->material && o->material->emissive) {
+                    throw std::runtime_error("[Tira] Instanced shape has an emissive material, instances are never lights: " + name);
+                }
+            }
+        }
+
         // Load envmap specs.
         if (!doc.child("envmap").empty()) {
             auto const& node = doc.child("envmap");
@@ -375,11 +503,35 @@ namespace tira {
                 if (type == std::string("mc")) integrator_info.type = IntegratorType::MonteCarlo;
                 if (type == std::string("bdpt")) integrator_info.type = IntegratorType::Bidirectional;
             }
+            if (!node.attribute("sampler").empty()) {
+                auto const& sampler = node.attribute("sampler").as_string();
+                if (sampler == std::string("independent")) integrator_info.sampler = SamplerType::Independent;
+                if (sampler == std::string("sobol")) integrator_info.sampler = SamplerType::Sobol;
+                if (sampler == std::string("halton")) integrator_info.sampler = SamplerType::Halton;
+            }
 
             if (!node.child("clamp").empty()) {
                 integrator_info.clamping.min = node.child("clamp").attribute("min").as_float();
                 integrator_info.clamping.max = node.child("clamp").attribute("max").as_float();
             }
+            if (!node.child("adaptive").empty()) {
+                auto const& adaptive = node.child("adaptive");
+                REQUIRED_ATTRIBUTE(adaptive, "threshold");
+                integrator_info.adaptive.threshold = adaptive.attribute("threshold").as_float();
+                if (!adaptive.attribute("minspp").empty())
+                    integrator_info.adaptive.min_spp = adaptive.attribute("minspp").as_int();
+                if (!adaptive.attribute("maxspp").empty())
+                    integrator_info.adaptive.max_spp = adaptive.attribute("maxspp").as_int();
+            }
+            if (!node.child("progressive").empty()) {
+                auto const& progressive = node.child("progressive");
+                if (!progressive.attribute("time").empty())
+                    integrator_info.progressive.time = progressive.attribute("time").as_float();
+                if (!progressive.attribute("noise").empty())
+                    integrator_info.progressive.noise = progressive.attribute("noise").as_float();
+                if (!progressive.attribute("passspp").empty())
+                    integrator_info.progressive.pass_spp = progressive.attribute("passspp").as_int();
+            }
         }
 
         // Load tiling specs.
@@ -389,23 +541,77 @@ namespace tira {
             kernel_info.size = node.attribute("size").as_int();
             if (!node.attribute("macro").empty())
                 kernel_info.macro = node.attribute("macro").as_string();
+            if (!node.attribute("order").empty()) {
+                auto order = node.attribute("order").as_string();
+                if (order == std::string("scanline")) kernel_info.order = TileOrder::Scanline;
+                if (order == std::string("morton")) kernel_info.order = TileOrder::Morton;
+                if (order == std::string("spiral")) kernel_info.order = TileOrder::Spiral;
+            }
         }
 
         /////////////////////////////////////////////
         // Build accelerate structure.
         /////////////////////////////////////////////
+        build_accel(std::forward<std::vector<Object*>>(objects));
+
+        setup_lights();
+    }
+
+    void Scene::build_accel(std::vector<Object*>&& objects) {
         switch (accel_type) {
-        case AcceleratorType::BVH:
-            accel = new BVHAccel(); break;
+        case AcceleratorType::BVH: {
+            auto bvh = new BVHAccel(2, accel_info.split_method);
+            bvh->traversal_method = accel_info.traversal_method;
+            bvh->optimize = accel_info.optimize;
+            accel = bvh;
+        } break;
+        case AcceleratorType::BVH4:
+            accel = new BVH4Accel(4, accel_info.split_method); break;
+        case AcceleratorType::BVH8:
+            accel = new BVH8Accel(8, accel_info.split_method); break;
         case AcceleratorType::Octree:
             accel = new OctreeAccel(); break;
+        case AcceleratorType::KdTree:
+            accel = new KdTreeAccel(); break;
+        case AcceleratorType::Grid:
+            accel = new GridAccel(); break;
+        case AcceleratorType::CBVH8:
+            accel = new CompressedBVH8Accel(2, accel_info.split_method); break;
+        case AcceleratorType::CBVH16:
+            accel = new CompressedBVH16Accel(2, accel_info.split_method); break;
+        case AcceleratorType::LazyBVH:
+            accel = new LazyBVHAccel(); break;
         }
         std::cout << "[Tira] " << "Building accleration Structure ... please wait ...\n";
         timer.update();
         accel->build(std::forward<std::vector<Object*>>(objects));
+        shadow_cache.reset(accel->bound);
         timer.update();
         std::cout << "[Tira] " << "Accleration Structure build elapsed time: " << timer.delta_time() << "s\n";
+    }
+
+    // Rebuild with current accel_type and accel_info, objects are handed over so lights stay valid.
+    void Scene::rebuild_accel() {
+        std::vector<Object*> objects = std::move(accel->objects);
+        accel->objects.clear();
+        delete accel;
+        build_accel(std::move(objects));
+    }
 
+    /**
+     * Update accel after positions of objects changed, e.g. for the next frame of a deforming mesh.
+     * BVH is refitted keeping its topology, the other accelerators are rebuilt.
+     * Lights are set up again since their areas may have changed.
+     */
+    void Scene::refit_accel() {
+        if (accel_type == AcceleratorType::BVH) {
+            static_cast<BVHAccel*>(accel)->refit();
+            shadow_cache.reset(accel->bound);
+        }
+        else {
+            for (auto& o : accel->objects) o->update_geometry();
+            rebuild_accel();
+        }
         setup_lights();
     }
 
@@ -430,15 +636,7 @@ namespace tira {
         Ray ray(P + offset, wi);
         ray.shadow_ray = true;
 
-        Intersection isect;
-        intersect(ray, isect);
-
-        if (isect.hit) {
-            geom = 0.f;
-        }
-        else {
-            geom = 1.f;
-        }
+        geom = occluded(ray, FLOAT_MAX, sun_light_id()) ? 0.f : 1.f;
 
         return sun_radiance;
     }
@@ -452,15 +650,7 @@ namespace tira {
         Ray ray(P + offset, wi);
         ray.shadow_ray = true;
 
-        Intersection isect;
-        intersect(ray, isect);
-
-        if (isect.hit) {
-            geom = 0.f;
-        }
-        else {
-            geom = 1.f;
-        }
+        geom = occluded(ray, FLOAT_MAX, envmap_light_id()) ? 0.f : 1.f;
 
         return envmap->sample(wi);
     }
@@ -470,7 +660,7 @@ namespace tira {
         lights_cdf.clear();
         lights_total_area = 0;
         for (auto& o : accel->objects) {
-            if (o->material->emissive) {
+            if (o->material && o->material->emissive) {
                 lights_total_area += o->get_area();
                 lights.push_back(o);
                 lights_cdf.push_back(lights_total_area);
@@ -494,12 +684,12 @@ namespace tira {
 
                 // Avoid seam-like artifacts, query a shadow ray with a small step.
                 float3 offset = dot(wi, isect.normal) > 0 ? isect.normal * rEPSILON : -isect.normal * rEPSILON;
-#if 1
-            // Visibility test by object pointer
+#if 0
+                // Visibility test by object pointer
                 float visibility = visibility_test(P + offset, wi, isect.object);
 #else
-                // Visibility test by distance
-                float visibility = visibility_test(P + offset, wi, length(PQ));
+                // Visibility test by distance, terminates at the first occluder.
+                float visibility = visibility_test(P + offset, wi, length(PQ), i);
 #endif
 
                 // Geometric term as in:
@@ -560,36 +750,20 @@ namespace tira {
         return 0.f;
     }
 
-    float Scene::visibility_test(float3 const& P, float3 const& wi, float dist) const {
+    float Scene::visibility_test(float3 const& P, float3 const& wi, float dist, int light) const {
         Ray ray(P, wi);
         ray.shadow_ray = true;
 
-        Intersection isect;
-        intersect(ray, isect);
-
-        if (!isect.hit) return 1.f;
-
-        float d = isect.distance * (1.01f);
-
-        if (d >= dist) return 1.f;
+        // Occluders within 1% of the distance are ignored, so that the target itself is not counted.
+        if (occluded(ray, dist / 1.01f, light)) return 0.f;
 
-        return 0.f;
+        return 1.f;
     }
 
     bool Scene::hit_sun(float3 const& wi) const {
         return std::abs(dot(sun_direction, wi)) > (1.0f - sun_solid_angle * TWO_PI);
     }
 
-    std::vector<float2> generate_poisson_dist(size_t num) {
-        PoissonGenerator::DefaultPRNG PRNG;
-        auto const poisson_points = PoissonGenerator::generatePoissonPoints(num, PRNG, true);
-        std::vector<float2> poisson_disk;
-        for (auto& p : poisson_points) {
-            poisson_disk.emplace_back(p.x - .5f, p.y - .5f);
-        }
-        return poisson_disk;
-    }
-
     void Scene::generate_simple_scene() {
         auto light = new BlinnPhongMaterial{};
         light->emissive = true;
@@ -647,6 +821,7 @@ namespace tira {
 
         accel = new BVHAccel();
         accel->build(std::forward<std::vector<Object*>>(objects));
+        shadow_cache.reset(accel->bound);
 
         camera.fov = 20.f;
         camera.eye = { 0.f, 4.f, 12.f };
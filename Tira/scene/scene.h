@@ -13,10 +13,14 @@
 #include <misc/utils.h>
 #include <misc/image.h>
 #include <misc/timer.h>
+#include <misc/scheduler.h>
+#include <misc/sampler.h>
 #include <geometry/object.h>
 #include <geometry/ray.h>
 #include <scene/material.h>
 #include <scene/accel.h>
+#include <scene/bvh.h>
+#include <scene/shadowcache.h>
 #include <scene/camera.h>
 
 namespace tira {
@@ -34,15 +38,36 @@ namespace tira {
             bool use_mis = true;
             int max_bounce = 8;
             bool robust_light = true; // Accept intersection very close to light as light intersection.
+            SamplerType sampler = SamplerType::Sobol;
             struct Clamping {
                 float min = 0.0f;
                 float max = std::numeric_limits<float>::max();
             } clamping;
+            // Pixels stop once their relative error is below threshold, spp is then the average budget per pixel.
+            struct Adaptive {
+                float threshold = 0.0f; // Disabled while 0.
+                int min_spp = 16;
+                int max_spp = 1024;
+            } adaptive;
+            // Full passes until spp, the time budget or the noise target is reached.
+            struct Progressive {
+                float time = 0.0f; // Seconds, no limit while 0.
+                float noise = 0.0f; // Average relative error of the pixels, no limit while 0.
+                int pass_spp = 1;
+            } progressive;
         };
 
+        // Tiles of GPU compute kernels, and of the CPU renderer with RENDER_TILED.
         struct TilingInfo {
             int size = 64;
             std::string macro = "";
+            TileOrder order = TileOrder::Morton;
+        };
+
+        struct AcceleratorInfo {
+            BVHAccel::SplitMethod split_method = BVHAccel::DEFAULT_SPLIT_METHOD;
+            BVHAccel::TraversalMethod traversal_method = BVHAccel::DEFAULT_TRAVERSAL_METHOD;
+            bool optimize = false;
         };
 
         int scr_w = 1024;
@@ -60,7 +85,14 @@ namespace tira {
 
         enum struct AcceleratorType {
             BVH,
+            BVH4,
+            BVH8,
             Octree,
+            KdTree,
+            Grid,
+            CBVH8,
+            CBVH16,
+            LazyBVH,
         };
 
         enum struct MaterialType {
@@ -69,9 +101,11 @@ namespace tira {
         };
 
         AcceleratorType accel_type = AcceleratorType::BVH;
+        AcceleratorInfo accel_info;
         Camera camera;
         float4x4 model = float4x4::identity();
         Accelerator* accel = nullptr;
+        mutable ShadowCache shadow_cache;
         std::vector<Material*> materials;
 
         /// Envmap ///
@@ -94,20 +128,27 @@ namespace tira {
         float4x4 get_transform() const;
         void draw_wireframe(Image& image, colorf const& color) const;
         void intersect(Ray& ray, Intersection& isect) const;
+        // Closest hits of n coherent rays, such as camera rays of neighbouring pixels.
+        void intersect_packet(Ray* rays, Intersection* isects, int n) const;
+        // Light is the index of the target light for the shadow cache, or -1 if the ray is not toward a light.
+        bool occluded(Ray& ray, float t_max = FLOAT_MAX, int light = -1) const;
+        int sun_light_id() const { return lights.size(); }
+        int envmap_light_id() const { return lights.size() + 1; }
 
         void generate_simple_scene();
         void load(std::string const& obj_path, std::string const& xml_path, MaterialType material_type);
+        void build_accel(std::vector<Object*>&& objects);
+        void rebuild_accel();
+        void refit_accel();
         void setup_lights();
         void sample_light(float3 const& P, Intersection& isect, float3& wi, float& pdf, float& geom) const;
         Ray sample_light_ray(float3& emission, float& pdf) const;
         float visibility_test(float3 const& P, float3 const& wi, Object const* object) const;
-        float visibility_test(float3 const& P, float3 const& wi, float dist) const;
+        float visibility_test(float3 const& P, float3 const& wi, float dist, int light = -1) const;
         bool hit_sun(float3 const& wi) const;
 
     };
 
-    std::vector<float2> generate_poisson_dist(size_t num);
-
 } // namespace tira
 
 #endif
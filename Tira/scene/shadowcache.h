@@ -0,0 +1,116 @@
+//
+// Created by Ziyi.Lu 2023/04/28
+//
+
+#ifndef SHADOWCACHE_H
+#define SHADOWCACHE_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <scene/accel.h>
+
+namespace tira {
+
+    /**
+     * Per-thread cache of the last object that occluded a shadow ray toward a light from a cell of the scene.
+     * A query tests the cached object first and only traverses the accelerator when it does not occlude the ray,
+     * so the answer is always exact, a hit just skips the traversal.
+     */
+    struct ShadowCache {
+        std::atomic<uint64_t> queries = 0;
+        std::atomic<uint64_t> hits = 0;
+
+        // Empties the caches of all threads, to be called once objects are rebuilt into accel.
+        void reset(Bound3f const& bound) {
+            static std::atomic<uint32_t> next_generation = 1;
+            generation = next_generation.fetch_add(1, std::memory_order_relaxed);
+            float3 extent = bound.get_extent();
+            float max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+            origin = bound.min;
+            inv_cell_size = max_extent > 0 ? SHADOW_CACHE_RESOLUTION / max_extent : 1.f;
+            queries = 0;
+            hits = 0;
+        }
+
+        // Whether any object of accel occludes the ray in [t_min, t_max), light identifies the target of the ray.
+        bool occluded(Accelerator* accel, Ray& ray, float t_max, int light) {
+            auto& table = get_table();
+            if (table.generation != generation) {
+                for (auto& e : table.entries) e = Entry();
+                table.generation = generation;
+                table.queries = 0;
+                table.hits = 0;
+            }
+            if (++table.queries == FLUSH_INTERVAL) flush(table);
+
+            uint64_t key = get_key(ray.origin, light);
+            auto& entry = table.entries[key % SHADOW_CACHE_SIZE];
+            if (entry.key == key && entry.occluder && entry.occluder->occluded(ray, t_max)) {
+                ++table.hits;
+                return true;
+            }
+
+            if (!accel->occluded(ray, t_max)) return false;
+            entry.key = key;
+            entry.occluder = last_occluder;
+            return true;
+        }
+
+        // Adds the counters of the calling thread to the shared ones, each rendering thread calls it before print.
+        void flush_thread() {
+            auto& table = get_table();
+            if (table.generation == generation) flush(table);
+        }
+
+        void print() const {
+            double n = std::max<uint64_t>(queries, 1);
+            std::cout << "[Tira] Shadow cache: queries: " << queries << ", hit rate: " << hits / n * 100. << "%\n";
+        }
+
+    private:
+        // Counters of a thread are added to the shared ones every FLUSH_INTERVAL queries.
+        static constexpr uint64_t FLUSH_INTERVAL = 4096;
+
+        // Empty while occluder is null.
+        struct Entry {
+            uint64_t key = 0;
+            Object const* occluder = nullptr;
+        };
+
+        struct Table {
+            uint32_t generation = 0;
+            uint64_t queries = 0;
+            uint64_t hits = 0;
+            Entry entries[SHADOW_CACHE_SIZE];
+        };
+
+        uint32_t generation = 0;
+        float3 origin;
+        float inv_cell_size = 1.f;
+
+        static Table& get_table() {
+            thread_local Table table;
+            return table;
+        }
+
+        void flush(Table& table) {
+            queries.fetch_add(table.queries, std::memory_order_relaxed);
+            hits.fetch_add(table.hits, std::memory_order_relaxed);
+            table.queries = 0;
+            table.hits = 0;
+        }
+
+        uint64_t get_key(float3 const& P, int light) const {
+            float3 p = (P - origin) * inv_cell_size;
+            uint64_t x = uint32_t(int(std::floor(p.x))) & 0xfffff;
+            uint64_t y = uint32_t(int(std::floor(p.y))) & 0xfffff;
+            uint64_t z = uint32_t(int(std::floor(p.z))) & 0xfffff;
+            uint64_t h = (x | y << 20 | z << 40) * 0x9e3779b97f4a7c15ull;
+            return h ^ (uint64_t(light) * 0xc2b2ae3d27d4eb4full);
+        }
+    };
+
+} // namespace tira
+
+#endif
@@ -0,0 +1,168 @@
+//
+// Created by Ziyi.Lu 2023/04/26
+//
+
+#include <limits>
+#include <utility>
+#include <scene/bvh.h>
+#include <misc/timer.h>
+
+namespace tira {
+
+    /**
+     * Treelet restructuring as in: Tero Karras and Timo Aila, Fast Parallel Construction of High-Quality Bounding Volume Hierarchies.
+     * A treelet grows from an inner node by opening its largest inner treelet leaf until TREELET_SIZE leaves are gathered,
+     * then the binary tree over these leaves with the lowest SAH cost is found by dynamic programming over leaf subsets
+     * and replaces the treelet, reusing its inner nodes. Subtrees are optimized before their root, in parallel.
+     */
+    void BVHAccel::optimize_treelets() {
+        Timer timer;
+        float cost_before = sah_cost();
+        float cost = cost_before;
+        std::vector<float> costs(nodes.size());
+
+        int pass = 0;
+        while (pass < BVH_OPTIMIZE_PASSES) {
+            ++pass;
+#ifdef _OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+            restructure(0, 0, costs);
+
+            float new_cost = sah_cost();
+            bool converged = new_cost > cost * .99f;
+            cost = new_cost;
+            if (converged) break;
+        }
+
+        timer.update();
+        std::cout << "[Tira] " << "BVH optimization time: " << timer.delta_time() << "s, passes: " << pass
+            << ", SAH cost: " << cost_before << " -> " << cost << "\n";
+    }
+
+    // Restructures the subtrees of idx, then the treelet rooted at idx. costs[i] is set to the SAH cost of subtree i, not normalized.
+    void BVHAccel::restructure(int idx, int depth, std::vector<float>& costs) {
+        constexpr float traversal_cost = 1.f;
+        constexpr float intersect_cost = 1.f;
+        // Subsets of treelet leaves, bit i stands for leaves[i].
+        constexpr int SUBSETS = 1 << TREELET_SIZE;
+
+        if (nodes[idx].is_leaf()) {
+            costs[idx] = nodes[idx].bound.get_surface_area() * nodes[idx].prim_count * intersect_cost;
+            return;
+        }
+
+        int left = nodes[idx].left;
+        int right = nodes[idx].right;
+#ifdef _OPENMP
+        // Deep enough for every thread to get several subtrees.
+        if (depth < 10) {
+#pragma omp task shared(costs)
+            restructure(left, depth + 1, costs);
+            restructure(right, depth + 1, costs);
+#pragma omp taskwait
+        }
+        else
+#endif
+        {
+            restructure(left, depth + 1, costs);
+            restructure(right, depth + 1, costs);
+        }
+
+        float area = nodes[idx].bound.get_surface_area();
+        float old_cost = area * traversal_cost + costs[left] + costs[right];
+        costs[idx] = old_cost;
+
+        // Form the treelet.
+        int leaves[TREELET_SIZE] = { left, right };
+        int inner[TREELET_SIZE - 1] = { idx };
+        int n = 2;
+        int inner_count = 1;
+        while (n < TREELET_SIZE) {
+            int best = -1;
+            float best_area = -1.f;
+            for (int i = 0; i < n; ++i) {
+                auto const& c = nodes[leaves[i]];
+                if (c.is_leaf()) continue;
+                float a = c.bound.get_surface_area();
+                if (a > best_area) {
+                    best_area = a;
+                    best = i;
+                }
+            }
+            if (best < 0) break;
+
+            int opened = leaves[best];
+            inner[inner_count++] = opened;
+            leaves[best] = nodes[opened].left;
+            leaves[n++] = nodes[opened].right;
+        }
+        // Two leaves under the root have only one arrangement.
+        if (n < 3) return;
+
+        // Bound of every subset, built from the subset without its highest leaf.
+        int full = (1 << n) - 1;
+        Bound3f bounds[SUBSETS];
+        for (int s = 1; s <= full; ++s) {
+            int high = 0;
+            while (s >> (high + 1)) ++high;
+            bounds[s] = bounds[s & ~(1 << high)];
+            bounds[s] += nodes[leaves[high]].bound;
+        }
+
+        // best[s] is the lowest cost of a tree over subset s, split[s] the part holding its lowest leaf.
+        float best[SUBSETS];
+        int split[SUBSETS];
+        for (int s = 1; s <= full; ++s) {
+            if ((s & (s - 1)) == 0) {
+                int i = 0;
+                while (!(s & (1 << i))) ++i;
+                best[s] = costs[leaves[i]];
+                continue;
+            }
+            int lowest = s & -s;
+            best[s] = std::numeric_limits<float>::max();
+            for (int p = (s - 1) & s; p; p = (p - 1) & s) {
+                if (!(p & lowest)) continue;
+                float c = best[p] + best[s ^ p];
+                if (c < best[s]) {
+                    best[s] = c;
+                    split[s] = p;
+                }
+            }
+            best[s] += bounds[s].get_surface_area() * traversal_cost;
+        }
+
+        if (best[full] >= old_cost * (1.f - 1e-5f)) return;
+
+        // Rebuild the treelet top-down, the root keeps its slot and other subsets take the freed inner nodes.
+        int next_inner = 1;
+        std::pair<int, int> tasks[TREELET_SIZE - 1] = { { full, idx } };
+        int task_count = 1;
+        while (task_count > 0) {
+            auto [s, slot] = tasks[--task_count];
+            int parts[2] = { split[s], s ^ split[s] };
+            int children[2];
+            for (int j = 0; j < 2; ++j) {
+                int q = parts[j];
+                if ((q & (q - 1)) == 0) {
+                    int i = 0;
+                    while (!(q & (1 << i))) ++i;
+                    children[j] = leaves[i];
+                }
+                else {
+                    children[j] = inner[next_inner++];
+                    tasks[task_count++] = { q, children[j] };
+                }
+            }
+            auto& node = nodes[slot];
+            node.left = children[0];
+            node.right = children[1];
+            node.prim_count = 0;
+            node.bound = bounds[s];
+            costs[slot] = best[s];
+        }
+    }
+
+} // namespace tira
@@ -0,0 +1,358 @@
+//
+// Created by Ziyi.Lu 2023/04/12
+//
+
+#include <scene/wbvh.h>
+#include <math/simd.h>
+#include <misc/timer.h>
+#include <geometry/triangle.h>
+
+namespace tira {
+
+    // Ray broadcast to N lanes, near and far planes are selected by the direction sign.
+    template <int N>
+    struct RayN {
+        vfloat<N> origin[3];
+        vfloat<N> direction[3];
+        vfloat<N> inv_dir[3];
+        int sign[3];
+        float t_min;
+
+        RayN(Ray const& ray) {
+            for (int a = 0; a < 3; ++a) {
+                origin[a] = vfloat<N>(ray.origin[a]);
+                direction[a] = vfloat<N>(ray.direction[a]);
+                inv_dir[a] = vfloat<N>(ray.inv_dir[a]);
+                sign[a] = ray.sign[a];
+            }
+            t_min = ray.t_min;
+        }
+    };
+
+    // Slab test of all children in [0, t_far], returns the mask of hit children and their entry distances.
+    template <int N>
+    static int intersect_children(WideBVHNode<N> const& node, RayN<N> const& ray, float t_far, float* t_near) {
+        vfloat<N> t0(0.f);
+        vfloat<N> t1(t_far);
+        for (int a = 0; a < 3; ++a) {
+            auto lo = vfloat<N>::load(ray.sign[a] ? node.bound_max[a] : node.bound_min[a]);
+            auto hi = vfloat<N>::load(ray.sign[a] ? node.bound_min[a] : node.bound_max[a]);
+            // NaN from 0 * inf keeps the previous value.
+            t0 = vmax((lo - ray.origin[a]) * ray.inv_dir[a], t0);
+            t1 = vmin((hi - ray.origin[a]) * ray.inv_dir[a], t1);
+        }
+        t0.store(t_near);
+        return t0 <= t1;
+    }
+
+    /**
+     * Möller–Trumbore test of all lanes in [t_min, t_far], same arithmetic as Triangle::intersect.
+     * Returns the mask of hit lanes with their distances and barycentrics.
+     */
+    template <int N>
+    static int intersect_triangles(TriangleN<N> const& tri, RayN<N> const& ray, float t_far, float* t, float* u, float* v) {
+        using vf = vfloat<N>;
+        vf v0[3], e01[3], e02[3];
+        for (int a = 0; a < 3; ++a) {
+            v0[a] = vf::load(tri.v0[a]);
+            e01[a] = vf::load(tri.e01[a]);
+            e02[a] = vf::load(tri.e02[a]);
+        }
+        auto const& d = ray.direction;
+
+        vf pvec[3] = {
+            d[1] * e02[2] - d[2] * e02[1],
+            d[2] * e02[0] - d[0] * e02[2],
+            d[0] * e02[1] - d[1] * e02[0],
+        };
+        vf det = e01[0] * pvec[0] + e01[1] * pvec[1] + e01[2] * pvec[2];
+        vf det_inv = vf(1.f) / det;
+
+        vf tvec[3] = { ray.origin[0] - v0[0], ray.origin[1] - v0[1], ray.origin[2] - v0[2] };
+        vf uu = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * det_inv;
+
+        vf qvec[3] = {
+            tvec[1] * e01[2] - tvec[2] * e01[1],
+            tvec[2] * e01[0] - tvec[0] * e01[2],
+            tvec[0] * e01[1] - tvec[1] * e01[0],
+        };
+        vf vv = (d[0] * qvec[0] + d[1] * qvec[1] + d[2] * qvec[2]) * det_inv;
+        vf tt = (e02[0] * qvec[0] + e02[1] * qvec[1] + e02[2] * qvec[2]) * det_inv;
+
+        int mask = (det >= vf(EPSILON)) | (det <= vf(-EPSILON));
+        mask &= (uu >= vf(0.f)) & (uu <= vf(1.f));
+        mask &= (vv >= vf(0.f)) & (uu + vv <= vf(1.f));
+        mask &= (tt >= vf(ray.t_min)) & (tt <= vf(t_far));
+        tt.store(t);
+        uu.store(u);
+        vv.store(v);
+        return mask;
+    }
+
+    template <int N>
+    void WideBVHAccel<N>::build(std::vector<Object*>&& _objects) {
+        BVHAccel bvh(max_objs, split_method);
+        bvh.typed_primitives = false;
+        bvh.compact_layout = false;
+        bvh.build(std::move(_objects));
+
+        Timer timer;
+        collapse(bvh.nodes);
+        objects = std::move(bvh.objects);
+        references = std::move(bvh.references);
+#ifdef WBVH_PACKED_TRIANGLES
+        pack_triangles();
+#endif
+        bound = bvh.bound;
+        // Each level pops one entry and pushes at most N.
+        stack_size = (N - 1) * max_height + 1;
+        timer.update();
+
+        std::cout << "[Tira] " << "BVH" << N << " collapse time: " << timer.delta_time()
+            << "s, nodes: " << nodes.size() << ", packed triangle blocks: " << triangles.size()
+            << ", max height: " << max_height << "\n";
+    }
+
+    template <int N>
+    void WideBVHAccel<N>::pack_triangles() {
+        auto const& prims = leaf_objects();
+        triangles.clear();
+        for (auto& node : nodes) {
+            for (int i = 0; i < N; ++i) {
+                int first = node.child[i];
+                int count = node.count[i];
+                if (count <= 0) continue;
+
+                bool all_triangles = true;
+                for (int j = 0; j < count; ++j) {
+                    if (!dynamic_cast<Triangle const*>(prims[first + j])) all_triangles = false;
+                }
+                if (!all_triangles) continue;
+
+                node.child[i] = triangles.size();
+                node.count[i] = -((count + N - 1) / N);
+                for (int j = 0; j < count; j += N) {
+                    TriangleN<N> block;
+                    for (int k = 0; k < N; ++k) {
+                        Triangle const* tri = j + k < count ? static_cast<Triangle const*>(prims[first + j + k]) : nullptr;
+                        for (int a = 0; a < 3; ++a) {
+                            block.v0[a][k] = tri ? tri->pos[0][a] : 0.f;
+                            block.e01[a][k] = tri ? tri->e01[a] : 0.f;
+                            block.e02[a][k] = tri ? tri->e02[a] : 0.f;
+                        }
+                        block.prim[k] = tri ? first + j + k : -1;
+                    }
+                    triangles.push_back(block);
+                }
+            }
+        }
+    }
+
+    template <int N>
+    void WideBVHAccel<N>::collapse(std::vector<BVHNode> const& bvh_nodes) {
+        nodes.clear();
+        nodes.emplace_back();
+        max_height = 0;
+
+        struct Task {
+            int bvh_idx;
+            int idx;
+            int height;
+        };
+        std::vector<Task> tasks = { { 0, 0, 1 } };
+
+        while (!tasks.empty()) {
+            auto task = tasks.back();
+            tasks.pop_back();
+            if (task.height > max_height) max_height = task.height;
+
+            int children[N];
+            int n = 0;
+            auto const& bvh_node = bvh_nodes[task.bvh_idx];
+            if (bvh_node.is_leaf()) {
+                children[n++] = task.bvh_idx;
+            }
+            else {
+                children[n++] = bvh_node.left;
+                children[n++] = bvh_node.right;
+                // Open the inner child with the largest surface area until all slots are used.
+                while (n < N) {
+                    int best = -1;
+                    float best_area = -1.f;
+                    for (int i = 0; i < n; ++i) {
+                        auto const& c = bvh_nodes[children[i]];
+                        if (c.is_leaf()) continue;
+                        float area = c.bound.get_surface_area();
+                        if (area > best_area) {
+                            best_area = area;
+                            best = i;
+                        }
+                    }
+                    if (best < 0) break;
+
+                    auto const& c = bvh_nodes[children[best]];
+                    children[best] = c.left;
+                    children[n++] = c.right;
+                }
+            }
+
+            WideBVHNode<N> node;
+            for (int i = 0; i < N; ++i) {
+                Bound3f b;
+                node.child[i] = 0;
+                node.count[i] = 0;
+                if (i < n) {
+                    auto const& c = bvh_nodes[children[i]];
+                    b = c.bound;
+                    if (c.is_leaf()) {
+                        node.child[i] = c.first_prim;
+                        node.count[i] = c.prim_count;
+                    }
+                    else {
+                        node.child[i] = nodes.size();
+                        nodes.emplace_back();
+                        tasks.push_back({ children[i], node.child[i], task.height + 1 });
+                    }
+                }
+                for (int a = 0; a < 3; ++a) {
+                    node.bound_min[a][i] = b.min[a];
+                    node.bound_max[a][i] = b.max[a];
+                }
+            }
+            nodes[task.idx] = node;
+        }
+    }
+
+    template <int N>
+    typename WideBVHAccel<N>::StackEntry* WideBVHAccel<N>::get_stack() const {
+        thread_local std::vector<StackEntry> stack;
+        if ((int)stack.size() < stack_size) stack.resize(stack_size);
+        return stack.data();
+    }
+
+    template <int N>
+    void WideBVHAccel<N>::intersect(Ray& ray, Intersection& isect) {
+        auto const& prims = leaf_objects();
+        RayN<N> ray_n(ray);
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { 0, 0, 0.f };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+            if (beyond_closest_hit(e.t, isect)) continue;
+
+            if (e.count > 0) {
+                for (int i = 0; i < e.count; ++i) {
+                    TRAVERSAL_STATS_PRIM();
+                    prims[e.child + i]->intersect(ray, isect);
+                }
+                continue;
+            }
+            if (e.count < 0) {
+                for (int b = 0; b < -e.count; ++b) {
+                    TRAVERSAL_STATS_PRIM();
+                    auto const& tri = triangles[e.child + b];
+                    float t[N], u[N], v[N];
+                    int mask = intersect_triangles(tri, ray_n, closest_hit_limit(isect), t, u, v);
+                    for (int i = 0; i < N; ++i) {
+                        if (mask & (1 << i)) {
+                            static_cast<Triangle const*>(prims[tri.prim[i]])->record_hit(t[i], u[i], v[i], isect);
+                        }
+                    }
+                }
+                continue;
+            }
+
+            auto const& node = nodes[e.child];
+            TRAVERSAL_STATS_NODE();
+
+            float t_near[N];
+            int mask = intersect_children(node, ray_n, closest_hit_limit(isect), t_near);
+
+            // Push hit children from far to near so that the nearest one is popped first.
+            StackEntry hits[N];
+            int n = 0;
+            for (int i = 0; i < N; ++i) {
+                if (!(mask & (1 << i))) continue;
+                int j = n++;
+                for (; j > 0 && hits[j - 1].t < t_near[i]; --j) hits[j] = hits[j - 1];
+                hits[j] = { node.child[i], node.count[i], t_near[i] };
+            }
+            for (int i = 0; i < n; ++i) stack[ptr++] = hits[i];
+        }
+
+        TRAVERSAL_STATS_RAY();
+    }
+
+    template <int N>
+    bool WideBVHAccel<N>::occluded(Ray& ray, float t_max) {
+        auto const& prims = leaf_objects();
+        RayN<N> ray_n(ray);
+        auto stack = get_stack();
+        int ptr = 0;
+        stack[ptr++] = { 0, 0, 0.f };
+
+        while (ptr > 0) {
+            auto e = stack[--ptr];
+
+            if (e.count > 0) {
+                for (int i = 0; i < e.count; ++i) {
+                    TRAVERSAL_STATS_PRIM();
+                    if (prims[e.child + i]->occluded(ray, t_max)) {
+                        last_occluder = prims[e.child + i];
+                        TRAVERSAL_STATS_RAY();
+                        return true;
+                    }
+                }
+                continue;
+            }
+            if (e.count < 0) {
+                for (int b = 0; b < -e.count; ++b) {
+                    TRAVERSAL_STATS_PRIM();
+                    float t[N], u[N], v[N];
+                    auto const& tri = triangles[e.child + b];
+                    int mask = intersect_triangles(tri, ray_n, t_max, t, u, v);
+                    for (int i = 0; i < N; ++i) {
+                        if ((mask & (1 << i)) && t[i] < t_max) {
+                            last_occluder = prims[tri.prim[i]];
+                            TRAVERSAL_STATS_RAY();
+                            return true;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            auto const& node = nodes[e.child];
+            TRAVERSAL_STATS_NODE();
+
+            float t_near[N];
+            int mask = intersect_children(node, ray_n, t_max, t_near);
+            for (int i = 0; i < N; ++i) {
+                if (mask & (1 << i)) stack[ptr++] = { node.child[i], node.count[i], t_near[i] };
+            }
+        }
+
+        TRAVERSAL_STATS_RAY();
+        return false;
+    }
+
+    template <int N>
+    void WideBVHAccel<N>::draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const {
+        bound.draw_wireframe(image, transform, color);
+        for (auto const& node : nodes) {
+            for (int i = 0; i < N; ++i) {
+                Bound3f b(
+                    { node.bound_min[0][i], node.bound_min[1][i], node.bound_min[2][i] },
+                    { node.bound_max[0][i], node.bound_max[1][i], node.bound_max[2][i] });
+                if (b.min.x > b.max.x) continue;
+                b.draw_wireframe(image, transform, color);
+            }
+        }
+    }
+
+    template struct WideBVHAccel<4>;
+    template struct WideBVHAccel<8>;
+
+} // namespace tira
@@ -0,0 +1,89 @@
+//
+// Created by Ziyi.Lu 2023/04/12
+//
+
+#ifndef WBVH_H
+#define WBVH_H
+
+#include <vector>
+#include <scene/bvh.h>
+
+namespace tira {
+
+    /**
+     * Node of N-ary BVH, bounds of all children are stored in SoA form so that
+     * one SIMD slab test covers every child. Empty slots have an empty bound.
+     */
+    template <int N>
+    struct WideBVHNode {
+        alignas(32) float bound_min[3][N];
+        alignas(32) float bound_max[3][N];
+        // Index of inner child node, first primitive of leaf child, or first block of packed leaf child.
+        int child[N];
+        // Primitive count of leaf child, 0 for inner child, negative block count of packed leaf child.
+        int count[N];
+    };
+
+    /**
+     * Up to N triangles of a leaf in SoA form, intersected together.
+     * Empty lanes have degenerate edges and never hit.
+     */
+    template <int N>
+    struct TriangleN {
+        alignas(32) float v0[3][N];
+        alignas(32) float e01[3][N];
+        alignas(32) float e02[3][N];
+        // Index into leaf objects, -1 for empty lane.
+        int prim[N];
+    };
+
+    /**
+     * BVH4/BVH8 collapsed from a binary BVHAccel built with the given split method.
+     * Each wide node takes the children of a binary node and repeatedly opens the
+     * largest inner child until N children are gathered.
+     * With WBVH_PACKED_TRIANGLES, leaves made of triangles only are packed into TriangleN blocks.
+     */
+    template <int N>
+    struct WideBVHAccel : Accelerator {
+        std::vector<WideBVHNode<N>> nodes;
+        std::vector<TriangleN<N>> triangles;
+        // Leaf references of the binary BVH when it is built with spatial splits, see BVHAccel::references.
+        std::vector<Object*> references;
+        BVHAccel::SplitMethod split_method;
+        int max_objs;
+        int max_height;
+        int stack_size = 0;
+
+        WideBVHAccel(int _max_objs = 4, BVHAccel::SplitMethod _split_method = BVHAccel::DEFAULT_SPLIT_METHOD)
+            : split_method(_split_method)
+            , max_objs(_max_objs) {}
+        ~WideBVHAccel() {}
+
+        virtual void build(std::vector<Object*>&& objects) override;
+        virtual void intersect(Ray& ray, Intersection& isect) override;
+        virtual bool occluded(Ray& ray, float t_max) override;
+        virtual void draw_wireframe(Image& image, float4x4 const& transform, colorf const& color) const override;
+
+        std::vector<Object*> const& leaf_objects() const { return references.empty() ? objects : references; }
+
+    private:
+        struct StackEntry {
+            int child;
+            int count;
+            float t;
+        };
+
+        void collapse(std::vector<BVHNode> const& bvh_nodes);
+        void pack_triangles();
+        StackEntry* get_stack() const;
+    };
+
+    using BVH4Accel = WideBVHAccel<4>;
+    using BVH8Accel = WideBVHAccel<8>;
+
+    extern template struct WideBVHAccel<4>;
+    extern template struct WideBVHAccel<8>;
+
+} // namespace tira
+
+#endif
@@ -10,6 +10,8 @@
 
 #include <misc/utils.h>
 #include <misc/timer.h>
+#include <misc/scheduler.h>
+#include <misc/sampler.h>
 #include <misc/image.h>
 
 #include <math/simd.h>
@@ -24,7 +26,14 @@
 #include <scene/scene.h>
 #include <scene/accel.h>
 #include <scene/bvh.h>
+#include <scene/wbvh.h>
 #include <scene/octree.h>
+#include <scene/kdtree.h>
+#include <scene/grid.h>
+#include <scene/cbvh.h>
+#include <scene/lazybvh.h>
+#include <scene/shadowcache.h>
+#include <scene/instance.h>
 #include <scene/camera.h>
 #include <scene/material.h>
 #include <scene/texture.h>
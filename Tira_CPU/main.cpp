@@ -4,6 +4,8 @@
 
 #include <iostream>
 #include <filesystem>
+#include <array>
+#include <cstdlib>
 #include <tira.h>
 
 // The executable file will be placed at root directory as default.
@@ -14,25 +16,40 @@
 using namespace tira;
 
 static std::string generate_output_filename(int spp, int w, int h, bool mis, std::string const& scene_name, Scene::IntegratorType type);
+static void run_benchmark(Scene& scene);
+static void run_refit_benchmark(Scene& scene, int frames);
 
 int main(int argc, char* argv[]) {
     Scene scene;
 
-    // Tira_CPU.exe scene_name
+    // Tira_CPU.exe scene_name [--bench | --refit [frames]]
     // your obj file and xml file is supporsed to be:
     //  - ROOT_DIT/Asset/scene_name/scene_name.obj
     //  - ROOT_DIT/Asset/scene_name/scene_name.xml
+    // with --bench, ray throughput of each BVH type is measured instead of rendering.
+    // with --refit, the scene is deformed for a number of frames and BVH refit is compared to rebuild.
     std::string scene_name = DEFAULT_SCENE;
     if (argc > 1) {
         scene_name = std::string(argv[1]);
         std::cout << "[Tira_CPU] Using Input Scene: " << scene_name << "\n";
     }
+    bool benchmark = argc > 2 && std::string(argv[2]) == "--bench";
+    bool refit_benchmark = argc > 2 && std::string(argv[2]) == "--refit";
 
     scene.load(
         std::string(ROOT_DIR) + "Asset/" + scene_name + "/" + scene_name + ".obj",
         std::string(ROOT_DIR) + "Asset/" + scene_name + "/" + scene_name + ".xml",
         Scene::MaterialType::BlinnPhong);
 
+    if (benchmark) {
+        run_benchmark(scene);
+        return EXIT_SUCCESS;
+    }
+    if (refit_benchmark) {
+        run_refit_benchmark(scene, argc > 3 ? std::atoi(argv[3]) : 16);
+        return EXIT_SUCCESS;
+    }
+
     auto spp = scene.integrator_info.spp;
     auto w = scene.scr_w;
     auto h = scene.scr_h;
@@ -51,11 +68,26 @@ int main(int argc, char* argv[]) {
     integrator->use_mis = scene.integrator_info.use_mis;
     integrator->clamp_min = scene.integrator_info.clamping.min;
     integrator->clamp_max = scene.integrator_info.clamping.max;
+    integrator->sampler_type = scene.integrator_info.sampler;
+    integrator->adaptive_threshold = scene.integrator_info.adaptive.threshold;
+    integrator->min_spp = scene.integrator_info.adaptive.min_spp;
+    integrator->max_spp = scene.integrator_info.adaptive.max_spp;
+    integrator->time_budget = scene.integrator_info.progressive.time;
+    integrator->noise_target = scene.integrator_info.progressive.noise;
+    integrator->pass_spp = scene.integrator_info.progressive.pass_spp;
 
     Image image(w, h);
-    integrator->render(image, scene, spp);
+    Image sample_map(w, h);
+    // Progressive rendering takes full passes and ignores adaptive sampling.
+    bool progressive = scene.integrator_info.progressive.time > 0 || scene.integrator_info.progressive.noise > 0;
+    bool adaptive = scene.integrator_info.adaptive.threshold > 0 && !progressive;
+    // A progressive render may stop early, the file name records the samples taken.
+    spp = integrator->render(image, scene, spp, adaptive ? &sample_map : nullptr);
     
-    image.write_PNG(generate_output_filename(spp, w, h, scene.integrator_info.use_mis, scene_name, scene.integrator_info.type));
+    auto filename = generate_output_filename(spp, w, h, scene.integrator_info.use_mis, scene_name, scene.integrator_info.type);
+    image.write_PNG(filename);
+    // Brighter pixels took more samples.
+    if (adaptive) sample_map.write_PNG(filename.substr(0, filename.size() - 4) + "_SAMPLES.png");
 
     return EXIT_SUCCESS;
 }
@@ -79,3 +111,184 @@ std::string generate_output_filename(int spp, int w, int h, bool mis, std::strin
     filename += ".png";
     return filename;
 }
+
+// Primary rays are traced coherently, secondary rays are diffuse bounces from primary hits.
+void run_benchmark(Scene& scene) {
+    int w = scene.scr_w;
+    int h = scene.scr_h;
+
+    std::vector<Ray> primary_rays;
+    primary_rays.reserve(w * h);
+    for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x) {
+        primary_rays.push_back(scene.camera.get_ray(x, y, w, h, float2(.5f)));
+    }
+
+#ifdef RAY_PACKET_SIZE
+    // The same primary rays grouped by blocks of pixels, one packet per block.
+    std::vector<Ray> packet_rays;
+    std::vector<int> packet_offsets;
+    packet_rays.reserve(w * h);
+    for (int y0 = 0; y0 < h; y0 += RAY_PACKET_SIZE) for (int x0 = 0; x0 < w; x0 += RAY_PACKET_SIZE) {
+        packet_offsets.push_back(packet_rays.size());
+        for (int y = y0; y < std::min(y0 + RAY_PACKET_SIZE, h); ++y) for (int x = x0; x < std::min(x0 + RAY_PACKET_SIZE, w); ++x) {
+            packet_rays.push_back(primary_rays[y * w + x]);
+        }
+    }
+    packet_offsets.push_back(packet_rays.size());
+#endif
+
+    std::vector<Ray> secondary_rays;
+    for (auto ray : primary_rays) {
+        Intersection isect;
+        scene.intersect(ray, isect);
+        if (!isect.hit) continue;
+        float3 N = isect.back_face ? -isect.normal : isect.normal;
+        secondary_rays.push_back(Ray(isect.position + N * rEPSILON, local_to_world(random_float3_on_unit_hemisphere(), N)));
+    }
+
+    auto trace = [&](std::vector<Ray> const& rays, bool shadow) {
+        Timer timer;
+        int hits = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : hits)
+#endif
+        for (int i = 0; i < (int)rays.size(); ++i) {
+            Ray ray = rays[i];
+            if (shadow) {
+                hits += scene.occluded(ray);
+            }
+            else {
+                Intersection isect;
+                scene.intersect(ray, isect);
+                hits += isect.hit;
+            }
+        }
+        timer.update();
+        return std::make_pair(rays.size() / timer.delta_time() * 1e-6, hits);
+    };
+
+#ifdef RAY_PACKET_SIZE
+    auto trace_packets = [&]() {
+        Timer timer;
+        int hits = 0;
+        int n = packet_offsets.size() - 1;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : hits)
+#endif
+        for (int i = 0; i < n; ++i) {
+            std::vector<Ray> rays(packet_rays.begin() + packet_offsets[i], packet_rays.begin() + packet_offsets[i + 1]);
+            std::vector<Intersection> isects(rays.size());
+            scene.intersect_packet(rays.data(), isects.data(), rays.size());
+            for (auto const& isect : isects) hits += isect.hit;
+        }
+        timer.update();
+        return std::make_pair(packet_rays.size() / timer.delta_time() * 1e-6, hits);
+    };
+#endif
+
+    std::pair<Scene::AcceleratorType, char const*> accels[] = {
+        { Scene::AcceleratorType::BVH, "bvh" },
+        { Scene::AcceleratorType::BVH4, "bvh4" },
+        { Scene::AcceleratorType::BVH8, "bvh8" },
+        { Scene::AcceleratorType::KdTree, "kdtree" },
+        { Scene::AcceleratorType::Grid, "grid" },
+        { Scene::AcceleratorType::CBVH8, "cbvh8" },
+        { Scene::AcceleratorType::CBVH16, "cbvh16" },
+        { Scene::AcceleratorType::LazyBVH, "lazybvh" },
+    };
+    for (auto const& [type, name] : accels) {
+        scene.accel_type = type;
+        scene.rebuild_accel();
+
+        // Repeat a few times and keep the best run.
+        float mrays[4] = { 0.f };
+        int hits[4] = { 0 };
+        for (int k = 0; k < 5; ++k) {
+            auto [p, ph] = trace(primary_rays, false);
+            auto [s, sh] = trace(secondary_rays, false);
+            auto [o, oh] = trace(secondary_rays, true);
+            mrays[0] = std::max<float>(mrays[0], p);
+            mrays[1] = std::max<float>(mrays[1], s);
+            mrays[2] = std::max<float>(mrays[2], o);
+            hits[0] = ph; hits[1] = sh; hits[2] = oh;
+#ifdef RAY_PACKET_SIZE
+            auto [pp, pph] = trace_packets();
+            mrays[3] = std::max<float>(mrays[3], pp);
+            hits[3] = pph;
+#endif
+        }
+        std::cout << "[Tira_CPU] Benchmark " << name << ": primary " << mrays[0] << " Mrays/s (" << hits[0] << " hits)"
+#ifdef RAY_PACKET_SIZE
+            << ", primary packets " << mrays[3] << " Mrays/s (" << hits[3] << " hits)"
+#endif
+            << ", secondary " << mrays[1] << " Mrays/s (" << hits[1] << " hits)"
+            << ", occlusion " << mrays[2] << " Mrays/s (" << hits[2] << " hits)\n";
+    }
+}
+
+// Every frame moves the scene along a travelling wave, then updates BVH by refitting it, or by rebuilding it.
+void run_refit_benchmark(Scene& scene, int frames) {
+    int w = scene.scr_w;
+    int h = scene.scr_h;
+    std::vector<Ray> primary_rays;
+    primary_rays.reserve(w * h);
+    for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x) {
+        primary_rays.push_back(scene.camera.get_ray(x, y, w, h, float2(.5f)));
+    }
+
+    scene.accel_type = Scene::AcceleratorType::BVH;
+    scene.rebuild_accel();
+
+    // Rest positions of the objects the wave moves, objects of instanced meshes stay in place.
+    std::vector<std::pair<Triangle*, std::array<float3, 3>>> triangles;
+    std::vector<std::pair<Sphere*, float3>> spheres;
+    for (auto o : scene.accel->objects) {
+        if (auto t = dynamic_cast<Triangle*>(o)) triangles.push_back({ t, { t->pos[0], t->pos[1], t->pos[2] } });
+        if (auto s = dynamic_cast<Sphere*>(o)) spheres.push_back({ s, s->center });
+    }
+    float3 extent = scene.accel->bound.get_extent();
+    float amplitude = .02f * std::max(extent.x, std::max(extent.y, extent.z));
+    float k = TWO_PI / std::max(extent.x, EPSILON);
+    auto deform = [&](int frame) {
+        auto wave = [&](float3 const& p) { return p + float3(0.f, amplitude * std::sin(k * p.x + .5f * frame), 0.f); };
+        for (auto& [t, rest] : triangles) for (int i = 0; i < 3; ++i) t->pos[i] = frame ? wave(rest[i]) : rest[i];
+        for (auto& [s, rest] : spheres) s->center = frame ? wave(rest) : rest;
+    };
+    auto rebuild = [&]() {
+        for (auto o : scene.accel->objects) o->update_geometry();
+        scene.rebuild_accel();
+        scene.setup_lights();
+    };
+
+    char const* names[] = { "refit", "rebuild" };
+    for (int mode = 0; mode < 2; ++mode) {
+        // Both start from a tree built on the rest pose.
+        deform(0);
+        rebuild();
+
+        double update_time = 0;
+        double mrays = 0;
+        for (int f = 1; f <= frames; ++f) {
+            deform(f);
+            Timer timer;
+            if (mode == 0) scene.refit_accel();
+            else rebuild();
+            timer.update();
+            update_time += timer.delta_time();
+
+            timer.reset();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+            for (int i = 0; i < (int)primary_rays.size(); ++i) {
+                Ray ray = primary_rays[i];
+                Intersection isect;
+                scene.intersect(ray, isect);
+            }
+            timer.update();
+            mrays += primary_rays.size() / timer.delta_time() * 1e-6;
+        }
+        std::cout << "[Tira_CPU] Refit benchmark " << names[mode] << ": " << update_time / frames * 1e3
+            << " ms/frame, primary " << mrays / frames << " Mrays/s over " << frames << " frames\n";
+    }
+}
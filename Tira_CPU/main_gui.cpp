@@ -57,6 +57,7 @@ int main(int argc, char* argv[]) {
     whittedIntegrator.max_depth = scene.integrator_info.max_bounce;
     monteCarloIntegrator.max_depth = scene.integrator_info.max_bounce;
     monteCarloIntegrator.use_mis = scene.integrator_info.use_mis;
+    monteCarloIntegrator.sampler_type = scene.integrator_info.sampler;
 
     image_width = scene.scr_w;
     image_height = scene.scr_h;
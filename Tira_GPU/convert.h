@@ -1,3 +1,4 @@
+#include <unordered_set>
 #include "tira.h"
 #include "glwrapper.h"
 
@@ -38,8 +39,9 @@ static glm::vec4 to_vec4(tira::float2 const& v) { return { v.x, v.y, 0.f, 0.f };
 static glm::vec4 to_vec4(tira::float3 const& v) { return { v.x, v.y, v.z, 0.f }; }
 static glm::vec3 to_vec3(tira::float3 const& v) { return { v.x, v.y, v.z }; }
 
+// Triangles in the order leaves of BVH index them, with spatial splits a triangle may appear more than once.
 inline std::vector<GL::Triangle> getTriangleList(tira::Scene const& scene) {
-    auto const& objs = scene.accel->objects;
+    auto const& objs = reinterpret_cast<tira::BVHAccel*>(scene.accel)->leaf_objects();
     auto const& mats = scene.materials;
     std::cout << "[Tira_GPU] Triangle count: " << objs.size() << "\n";
 
@@ -148,11 +150,13 @@ inline std::vector<GL::BVHNode> getBVHNodeList(tira::Scene const& scene) {
 }
 
 inline std::vector<int> getAreaLights(tira::Scene const& scene) {
-    auto const& objs = scene.accel->objects;
+    auto const& objs = reinterpret_cast<tira::BVHAccel*>(scene.accel)->leaf_objects();
 
+    // Each light is listed once even if it is referenced by several leaves.
+    std::unordered_set<tira::Object*> listed;
     std::vector<int> list;
     for (int i = 0; i < objs.size(); ++i) {
-        if (objs[i]->material->emissive) {
+        if (objs[i]->material->emissive && listed.insert(objs[i]).second) {
             list.push_back(i);
         }
     }